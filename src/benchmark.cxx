@@ -0,0 +1,657 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+// Performance benchmark for the rendering pipeline. Renders a fixed matrix of
+// tiles, synthetic depth maps, output sizes and viewing modes, reporting
+// timings per stage and throughput. Each output is also hashed and checked
+// against a straightforward reimplementation of the original two-pass
+// algorithm, and at the smallest size against recorded hashes, so that
+// optimisations can't silently change any pixels.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include "images.hxx"
+#include "render.hxx"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double ms_since(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // FNV-style hash of the rendered pixels, a whole pixel at a time
+    std::uint64_t hash_pixels(std::uint32_t const * pixels, std::size_t n)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325u ^ n;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            hash = (hash ^ pixels[i]) * 0x100000001b3u;
+            hash ^= hash >> 29;
+        }
+        return hash;
+    }
+
+    // Counts last level cache misses in this thread and any threads it
+    // starts, where the system allows it (Linux perf events)
+    class CacheMisses
+    {
+        public:
+            CacheMisses()
+            {
+#if defined(__linux__)
+                perf_event_attr attr = {};
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                attr.disabled = 1;
+                attr.inherit = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+            }
+
+            ~CacheMisses()
+            {
+#if defined(__linux__)
+                if (fd >= 0)
+                    close(fd);
+#endif
+            }
+
+            CacheMisses(CacheMisses const &) = delete;
+            CacheMisses & operator=(CacheMisses const &) = delete;
+
+            void start()
+            {
+#if defined(__linux__)
+                if (fd >= 0)
+                {
+                    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+                }
+#endif
+            }
+
+            // Misses since start(), or -1 if they can't be counted
+            long long stop()
+            {
+#if defined(__linux__)
+                long long count = 0;
+                if ((fd >= 0) && (ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == 0)
+                        && (read(fd, &count, sizeof(count)) == static_cast<ssize_t>(sizeof(count))))
+                    return count;
+#endif
+                return -1;
+            }
+
+        private:
+            int fd = -1;
+    };
+
+    // The original draw(): fill in one row of out from src, a tile-sized
+    // image, using a std::vector for the pattern and erasing & inserting in
+    // place. Slow, but simple enough to trust.
+    void reference_draw(std::uint32_t const * src, int tilew, int tileh, std::uint8_t const * depth,
+            std::uint32_t * out, int width, int y, bool cross, double l)
+    {
+        std::copy(src + (static_cast<std::size_t>(y % tileh) * tilew),
+                src + (static_cast<std::size_t>(y % tileh + 1) * tilew), out);
+        double c = (static_cast<double>(tilew) / l) / 256.0;
+        // Same random streams as the renderer, so that the same pixels are
+        // inserted
+        RowRandom rng(y);
+        std::uint32_t prev = 0;
+        std::vector<std::uint32_t> pattern(out, out + tilew);
+        double len = static_cast<double>(pattern.size());
+        auto pattern_it = pattern.begin();
+        for (int x = tilew; x < width; ++x)
+        {
+            std::uint32_t current = depth[x];
+            if (cross ? (current < prev) : (current > prev))
+            {
+                std::uint32_t disparity = cross ? (prev - current) : (current - prev);
+                double newlen = len - (static_cast<double>(disparity) * c);
+                disparity = static_cast<std::uint32_t>(pattern.size() - std::lround(newlen));
+                if (disparity > static_cast<std::uint32_t>(pattern.end() - pattern_it))
+                {
+                    auto to_end = pattern.end() - pattern_it;
+                    pattern.erase(pattern_it, pattern.end());
+                    auto remaining = disparity - to_end;
+                    unsigned offset = (pattern_it - pattern.begin()) - remaining;
+                    pattern.erase(pattern.begin(), pattern.begin() + remaining);
+                    offset %= pattern.size();
+                    pattern_it = pattern.begin() + offset;
+                }
+                else
+                {
+                    unsigned offset = pattern_it - pattern.begin();
+                    pattern.erase(pattern_it, pattern_it + disparity);
+                    offset %= pattern.size();
+                    pattern_it = pattern.begin() + offset;
+                }
+                len = newlen;
+            }
+            else if (cross ? (current > prev) : (current < prev))
+            {
+                std::uint32_t disparity = cross ? (current - prev) : (prev - current);
+                double newlen = len + (static_cast<double>(disparity) * c);
+                disparity = static_cast<std::uint32_t>(std::lround(newlen) - pattern.size());
+                len = newlen;
+                auto offset = pattern_it - pattern.begin();
+                int py = y - (rng.below(5) + 1);
+                py = (py < 0) ? (py + tileh) : (py % tileh);
+                std::uint32_t px = static_cast<std::uint32_t>(x % tilew);
+                std::uint32_t const to_edge = tilew - px;
+                std::uint32_t const * p = src + (static_cast<std::size_t>(py) * tilew) + px;
+                pattern.insert(pattern_it, p, p + std::min(disparity, to_edge));
+                pattern_it = pattern.begin() + offset;
+                if (disparity > to_edge)
+                {
+                    p -= px;
+                    pattern.insert(pattern_it + 1 + to_edge, p, p + (disparity - to_edge));
+                }
+                pattern_it = pattern.begin() + offset;
+            }
+            out[x] = *pattern_it;
+            prev = current;
+            if (++pattern_it == pattern.end())
+                pattern_it = pattern.begin();
+        }
+    }
+
+    struct ReferenceTimes
+    {
+        double gradient = 0;
+        double rearrange = 0;
+        double final = 0;
+    };
+
+    // The original two-pass pipeline: render a grid of tile coordinates to
+    // find out where each tile pixel ends up, rearrange the tile for each row
+    // accordingly, then render again from the rearranged tile
+    std::vector<std::uint32_t> reference_render(Tile const & tile, std::vector<std::uint8_t> const & depth,
+            int w, int h, bool cross, double l, unsigned jobs, ReferenceTimes & times)
+    {
+        std::size_t const n = static_cast<std::size_t>(w) * h;
+        std::vector<std::uint32_t> gradient(tile.pixels.size());
+        std::vector<std::uint32_t> offsets(n);
+        std::vector<std::uint32_t> out(n);
+
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < gradient.size(); ++i)
+            gradient[i] = static_cast<std::uint32_t>(i);
+        parallel_rows(h, jobs, [&](int row, unsigned)
+        {
+            std::size_t const at = static_cast<std::size_t>(row) * w;
+            reference_draw(gradient.data(), tile.w, tile.h, depth.data() + at, offsets.data() + at, w, row, cross, l);
+        });
+        times.gradient = ms_since(start);
+
+        start = Clock::now();
+        std::vector<std::uint32_t> rearranged(static_cast<std::size_t>(h) * tile.pixels.size());
+        parallel_rows(h, jobs, [&](int row, unsigned)
+        {
+            std::uint32_t * rearr = rearranged.data() + (static_cast<std::size_t>(row) * tile.pixels.size());
+            std::copy(tile.pixels.begin(), tile.pixels.end(), rearr);
+            std::uint32_t const * src = tile.pixels.data() + (static_cast<std::size_t>(row % tile.h) * tile.w);
+            std::uint32_t const * off = offsets.data() + (static_cast<std::size_t>(row) * w) + ((w / 2) - (tile.w / 2));
+            for (int x = 0; x < tile.w; ++x)
+                rearr[off[x]] = src[x];
+        });
+        times.rearrange = ms_since(start);
+
+        start = Clock::now();
+        parallel_rows(h, jobs, [&](int row, unsigned)
+        {
+            std::size_t const at = static_cast<std::size_t>(row) * w;
+            reference_draw(rearranged.data() + (static_cast<std::size_t>(row) * tile.pixels.size()),
+                    tile.w, tile.h, depth.data() + at, out.data() + at, w, row, cross, l);
+        });
+        times.final = ms_since(start);
+        return out;
+    }
+
+    // 5x7 bitmap glyphs for the synthetic text depth map
+    struct Glyph
+    {
+        char c;
+        std::uint8_t rows[7];
+    };
+
+    Glyph const glyphs[] = {
+        {'D', {0x1e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1e}},
+        {'E', {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}},
+        {'H', {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}},
+        {'L', {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}},
+        {'O', {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}},
+        {'R', {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}},
+        {'W', {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}},
+    };
+
+    std::uint8_t text_depth(int x, int y, int w, int h)
+    {
+        static char const text[] = "HELLO WORLD";
+        int const chars = sizeof(text) - 1;
+        // Each character cell is 6x9 glyph pixels, scaled to fit
+        int const scale = std::max(1, std::min(w / (chars * 6), h / 9));
+        int const gx = x / scale;
+        int const gy = (y - ((h - (9 * scale)) / 2)) / scale - 1;
+        if ((gx >= (chars * 6)) || (gy < 0) || (gy >= 7) || ((gx % 6) == 5))
+            return 0;
+        for (Glyph const & glyph : glyphs)
+        {
+            if (glyph.c == text[gx / 6])
+                return (glyph.rows[gy] & (0x10 >> (gx % 6))) ? 60 : 0;
+        }
+        return 0;
+    }
+
+    char const * const depthkinds[] = {"flat", "text", "gradient", "noise"};
+
+    // Synthetic depth map, as an ARGB32 surface with depth in every channel
+    SDL_Surface * synthetic_depth(char const * kind, int w, int h)
+    {
+        SDL_Surface * surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB32);
+        if (!surface)
+            return nullptr;
+        std::uint64_t state = 1;
+        for (int y = 0; y < h; ++y)
+        {
+            std::uint32_t * row = reinterpret_cast<std::uint32_t*>(
+                    static_cast<std::uint8_t*>(surface->pixels) + (surface->pitch * y));
+            for (int x = 0; x < w; ++x)
+            {
+                std::uint8_t d = 0;
+                if (kind == depthkinds[0])
+                    d = 128;
+                else if (kind == depthkinds[1])
+                    d = text_depth(x, y, w, h);
+                else if (kind == depthkinds[2])
+                    d = static_cast<std::uint8_t>((((x * 255) / w) + ((y * 255) / h)) / 2);
+                else
+                {
+                    state = (state * 6364136223846793005u) + 1442695040888963407u;
+                    d = static_cast<std::uint8_t>(state >> 56);
+                }
+                row[x] = SDL_MapRGBA(surface->format, d, d, d, 255);
+            }
+        }
+        return surface;
+    }
+
+    // Hashes of the smallest size of every image, as rendered when they were
+    // recorded. The reference implementation shares RowRandom with the
+    // renderer, so a change there would go unnoticed without these. Grey
+    // output hashes differently, so isn't checked against them.
+    struct KnownHash
+    {
+        char const * tile;
+        char const * depth;
+        bool cross;
+        std::uint64_t hash;
+    };
+
+    int const knownw = 1280;
+    int const knownh = 720;
+    KnownHash const knownhashes[] = {
+        {"gold_tile.png", "flat", false, 0xdd1f1796de710e21u},
+        {"gold_tile.png", "flat", true, 0x365c395b6b85cb9eu},
+        {"gold_tile.png", "text", false, 0x477763c6f27f6b01u},
+        {"gold_tile.png", "text", true, 0x606ecbb22a78a191u},
+        {"gold_tile.png", "gradient", false, 0xc4104b3f6202543du},
+        {"gold_tile.png", "gradient", true, 0xa8a31238153a0211u},
+        {"gold_tile.png", "noise", false, 0x5e1efcae912f0967u},
+        {"gold_tile.png", "noise", true, 0xe6935dd6f25b1d4eu},
+        {"parrot_tile.jpg", "flat", false, 0x7d27ceb164ef1ce6u},
+        {"parrot_tile.jpg", "flat", true, 0x5cc5ee617eb31addu},
+        {"parrot_tile.jpg", "text", false, 0x3ef3afd666a42fa5u},
+        {"parrot_tile.jpg", "text", true, 0x52a9d605d4ffa26du},
+        {"parrot_tile.jpg", "gradient", false, 0xf9544386438d7d4du},
+        {"parrot_tile.jpg", "gradient", true, 0xafb1d0259516b4cau},
+        {"parrot_tile.jpg", "noise", false, 0x4ec063a9417a40acu},
+        {"parrot_tile.jpg", "noise", true, 0x6c155022dcd5c54bu},
+    };
+
+    // The recorded hash of an image, or 0 if there isn't one
+    std::uint64_t known_hash(char const * tile, char const * depth, int w, int h, bool cross)
+    {
+        if ((w != knownw) || (h != knownh))
+            return 0;
+        for (KnownHash const & known : knownhashes)
+        {
+            if ((std::strcmp(known.tile, tile) == 0) && (std::strcmp(known.depth, depth) == 0) && (known.cross == cross))
+                return known.hash;
+        }
+        return 0;
+    }
+
+    // Output pixel formats which can be rendered into
+    struct Format
+    {
+        char const * name;
+        stereogram::PixelFormat format;
+    };
+
+    Format const formats[] = {
+        {"argb", stereogram::PixelFormat::ARGB32},
+        {"bgra", stereogram::PixelFormat::BGRA32},
+        {"rgba", stereogram::PixelFormat::RGBA32},
+        {"abgr", stereogram::PixelFormat::ABGR32},
+        {"grey", stereogram::PixelFormat::Grey8}
+    };
+
+    // Copy an image rendered in some other format into the canvas, so that
+    // it can be encoded and checked the same as any other
+    void to_canvas(std::vector<std::uint32_t> const & pixels, stereogram::PixelFormat format, SDL_Surface * canvas)
+    {
+        // Byte offsets of alpha, red, green & blue, or all -1 for grey
+        int a = 0, r = 1, g = 2, b = 3;
+        switch (format)
+        {
+            case stereogram::PixelFormat::BGRA32:
+                a = 3; r = 2; g = 1; b = 0;
+                break;
+            case stereogram::PixelFormat::RGBA32:
+                a = 3; r = 0; g = 1; b = 2;
+                break;
+            case stereogram::PixelFormat::ABGR32:
+                a = 0; r = 3; g = 2; b = 1;
+                break;
+            case stereogram::PixelFormat::Grey8:
+                a = r = g = b = -1;
+                break;
+            default:
+                break;
+        }
+        std::size_t const size = (format == stereogram::PixelFormat::Grey8) ? 1 : 4;
+        std::uint8_t const * src = reinterpret_cast<std::uint8_t const *>(pixels.data());
+        for (int y = 0; y < canvas->h; ++y)
+        {
+            std::uint32_t * dst = reinterpret_cast<std::uint32_t *>(
+                    static_cast<std::uint8_t *>(canvas->pixels) + (canvas->pitch * y));
+            for (int x = 0; x < canvas->w; ++x, src += size)
+            {
+                if (a < 0)
+                    dst[x] = SDL_MapRGBA(canvas->format, src[0], src[0], src[0], 255);
+                else
+                    dst[x] = SDL_MapRGBA(canvas->format, src[r], src[g], src[b], src[a]);
+            }
+        }
+    }
+
+    // Convert reference pixels to grey, as the renderer does for grey output
+    void to_grey(std::vector<std::uint32_t> & pixels, SDL_PixelFormat const * format)
+    {
+        for (std::uint32_t & pixel : pixels)
+        {
+            std::uint8_t r, g, b, a;
+            SDL_GetRGBA(pixel, format, &r, &g, &b, &a);
+            std::uint8_t const v = static_cast<std::uint8_t>(((r * 77) + (g * 150) + (b * 29) + 128) >> 8);
+            pixel = SDL_MapRGBA(format, v, v, v, 255);
+        }
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: benchmark [-r <repeats>] [-j <threads>] [-b <rows>] [-f <format>] [-q] <data directory>\n";
+        std::cerr << "Renders every combination of tile, synthetic depth map, size & viewing mode,\n";
+        std::cerr << "reporting the best time of each stage over the given number of repeats, and\n";
+        std::cerr << "last level cache misses per thousand pixels rendered where they can be counted.\n";
+        std::cerr << "With -b, each thread renders the given number of rows at a time (default:\n";
+        std::cerr << "automatic). With -f, output is rendered as argb (default), bgra, rgba, abgr\n";
+        std::cerr << "or grey pixels. With -q, only the smallest output size is rendered.\n";
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    int repeats = 3;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    int band = 0;
+    bool quick = false;
+    Format const * format = &formats[0];
+    {
+        int c;
+        while ((c = getopt(argc, argv, "r:j:b:f:q")) != -1)
+        {
+            switch (c)
+            {
+                case 'r':
+                    repeats = std::atoi(optarg);
+                    break;
+                case 'j':
+                    jobs = static_cast<unsigned>(std::max(0, std::atoi(optarg)));
+                    break;
+                case 'b':
+                    band = std::atoi(optarg);
+                    break;
+                case 'f':
+                    format = nullptr;
+                    for (Format const & f : formats)
+                    {
+                        if (std::strcmp(f.name, optarg) == 0)
+                            format = &f;
+                    }
+                    break;
+                case 'q':
+                    quick = true;
+                    break;
+                default:
+                    usage();
+                    return 1;
+            }
+        }
+    }
+    if ((optind != (argc - 1)) || (repeats <= 0) || (jobs == 0) || (band < 0) || (format == nullptr))
+    {
+        usage();
+        return 1;
+    }
+    std::string const datadir = argv[optind];
+
+    if (SDL_Init(0) != 0)
+    {
+        std::cerr << "Unable to initialise SDL: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    std::atexit(SDL_Quit);
+    if (IMG_Init(0) != 0)
+    {
+        std::cerr << "Unable to initialise SDL_image: " << IMG_GetError() << std::endl;
+        return 1;
+    }
+    std::atexit(IMG_Quit);
+
+    char const * const tilenames[] = {"gold_tile.png", "parrot_tile.jpg"};
+    struct Size
+    {
+        int w;
+        int h;
+    };
+    // The last is very wide but short, to show up cache effects
+    Size const sizes[] = {{1280, 720}, {1920, 1080}, {3840, 2160}, {16384, 512}};
+    int const nsizes = quick ? 1 : 4;
+
+    CacheMisses misses;
+    // Total render time & pixels for each viewing mode (wall, cross)
+    double modems[2] = {0, 0};
+    double modepx[2] = {0, 0};
+    std::printf("%-16s %-9s %-10s %-5s %9s %9s %9s %9s %9s %9s  %9s %9s %9s  %s\n",
+            "tile", "depth", "size", "mode", "load ms", "place ms", "render ms", "encode ms", "Mpx/s", "LLC/kpx",
+            "ref grad", "ref rearr", "ref final", "golden");
+    bool ok = true;
+    for (char const * tilename : tilenames)
+    {
+        Tile tile;
+        double load = 0;
+        for (int r = 0; r < repeats; ++r)
+        {
+            auto start = Clock::now();
+            if (!load_tile((datadir + "/" + tilename).c_str(), tile))
+            {
+                std::cerr << "Unable to load tile image: " << IMG_GetError() << std::endl;
+                return 1;
+            }
+            double t = ms_since(start);
+            load = (r == 0) ? t : std::min(load, t);
+        }
+
+        for (char const * kind : depthkinds)
+        {
+            for (int size = 0; size < nsizes; ++size)
+            {
+                int const w = sizes[size].w;
+                int const h = sizes[size].h;
+                SDL_Surface * depthsurface = synthetic_depth(kind, std::max(1, w - (tile.w * 2)), h);
+                if (!depthsurface)
+                {
+                    std::cerr << "Unable to create depth map: " << SDL_GetError() << std::endl;
+                    return 1;
+                }
+                SDL_Surface * canvas = create_canvas(w, h);
+                if (!canvas)
+                {
+                    std::cerr << "Unable to create canvas: " << SDL_GetError() << std::endl;
+                    return 1;
+                }
+                DepthPlane depthplane;
+                std::vector<std::uint32_t> pixels(static_cast<std::size_t>(w) * h);
+                // Rendered into when not rendering straight into the canvas
+                std::vector<std::uint32_t> target;
+                stereogram::Image output = canvas_image(canvas);
+                if (format->format != output.format)
+                {
+                    target.resize(pixels.size());
+                    std::ptrdiff_t const size = (format->format == stereogram::PixelFormat::Grey8) ? 1 : 4;
+                    output = {target.data(), w, h, w * size, format->format};
+                }
+                std::vector<std::uint8_t> encoded(pixels.size() * 5);
+
+                for (bool cross : {false, true})
+                {
+                    double place = 0;
+                    double render = 0;
+                    double encode = 0;
+                    long long llc = -1;
+                    stereogram::Context context(jobs);
+                    stereogram::Options options = canvas_options(cross, 2.0);
+                    options.band = band;
+                    for (int r = 0; r < repeats; ++r)
+                    {
+                        auto start = Clock::now();
+                        if (!place_depth(depthplane, depthsurface, w, h, tile.w))
+                        {
+                            std::cerr << "Unable to place depth map: " << SDL_GetError() << std::endl;
+                            return 1;
+                        }
+                        double t = ms_since(start);
+                        place = (r == 0) ? t : std::min(place, t);
+
+                        start = Clock::now();
+                        misses.start();
+                        if (!context.render(depthplane.image(), tile.image(), output, options))
+                        {
+                            std::cerr << "Unable to render: " << context.error() << std::endl;
+                            return 1;
+                        }
+                        long long const m = misses.stop();
+                        t = ms_since(start);
+                        render = (r == 0) ? t : std::min(render, t);
+                        llc = (r == 0) ? m : std::min(llc, m);
+                        if (!target.empty())
+                            to_canvas(target, format->format, canvas);
+
+                        start = Clock::now();
+                        SDL_RWops * rw = SDL_RWFromMem(encoded.data(), static_cast<int>(encoded.size()));
+                        if (!rw || (IMG_SavePNG_RW(canvas, rw, 1) != 0))
+                        {
+                            std::cerr << "Unable to encode PNG: " << IMG_GetError() << std::endl;
+                            return 1;
+                        }
+                        t = ms_since(start);
+                        encode = (r == 0) ? t : std::min(encode, t);
+                    }
+                    for (int y = 0; y < h; ++y)
+                    {
+                        std::uint32_t const * src = reinterpret_cast<std::uint32_t const *>(
+                                static_cast<std::uint8_t const *>(canvas->pixels) + (canvas->pitch * y));
+                        std::copy(src, src + w, pixels.begin() + (static_cast<std::size_t>(y) * w));
+                    }
+
+                    ReferenceTimes reftimes;
+                    std::vector<std::uint32_t> reference = reference_render(tile, depthplane.values, w, h, cross, 2.0, jobs, reftimes);
+                    if (format->format == stereogram::PixelFormat::Grey8)
+                        to_grey(reference, canvas->format);
+                    std::uint64_t const hash = hash_pixels(pixels.data(), pixels.size());
+                    bool const match = (hash == hash_pixels(reference.data(), reference.size()));
+                    std::uint64_t const known = (format->format == stereogram::PixelFormat::Grey8) ? 0
+                        : known_hash(tilename, kind, w, h, cross);
+                    bool const unchanged = (known == 0) || (hash == known);
+                    ok = ok && match && unchanged;
+                    modems[cross] += render;
+                    modepx[cross] += static_cast<double>(w) * h;
+
+                    std::string const dims = std::to_string(w) + "x" + std::to_string(h);
+                    char missed[32] = "n/a";
+                    if (llc >= 0)
+                        std::snprintf(missed, sizeof(missed), "%.2f", static_cast<double>(llc) * 1000.0 / (static_cast<double>(w) * h));
+                    std::printf("%-16s %-9s %-10s %-5s %9.2f %9.2f %9.2f %9.2f %9.1f %9s  %9.2f %9.2f %9.2f  %016llx %s\n",
+                            tilename, kind, dims.c_str(), cross ? "cross" : "wall",
+                            load, place, render, encode, (static_cast<double>(w) * h) / (render * 1000.0), missed,
+                            reftimes.gradient, reftimes.rearrange, reftimes.final,
+                            static_cast<unsigned long long>(hash), !match ? "MISMATCH" : (unchanged ? "ok" : "CHANGED"));
+                    std::fflush(stdout);
+                }
+                SDL_FreeSurface(canvas);
+                SDL_FreeSurface(depthsurface);
+            }
+        }
+    }
+    std::printf("\n%-5s %12s %9s\n", "mode", "render ms", "Mpx/s");
+    for (int cross = 0; cross < 2; ++cross)
+        std::printf("%-5s %12.2f %9.1f\n", cross ? "cross" : "wall", modems[cross], modepx[cross] / (modems[cross] * 1000.0));
+    if (!ok)
+    {
+        std::cerr << "Output differs from the reference implementation (MISMATCH) or recorded hashes (CHANGED)" << std::endl;
+        return 1;
+    }
+    return 0;
+}
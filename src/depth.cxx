@@ -0,0 +1,148 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include "depth.hxx"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    void extract_channel_scalar(std::uint32_t const * pixels, std::uint8_t * out, std::size_t n, unsigned shift)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            out[i] = static_cast<std::uint8_t>(pixels[i] >> shift);
+    }
+
+    std::size_t find_change_scalar(std::uint8_t const * row, std::size_t from, std::size_t n)
+    {
+        for (std::size_t i = from; i < n; ++i)
+        {
+            if (row[i] != row[i - 1])
+                return i;
+        }
+        return n;
+    }
+
+#ifdef HAVE_X86_SIMD
+    __attribute__((target("sse2")))
+    void extract_channel_sse2(std::uint32_t const * pixels, std::uint8_t * out, std::size_t n, unsigned shift)
+    {
+        __m128i const count = _mm_cvtsi32_si128(static_cast<int>(shift));
+        __m128i const mask = _mm_set1_epi32(0xff);
+        std::size_t i = 0;
+        for (; (i + 16) <= n; i += 16)
+        {
+            // Shift the wanted channel down to the bottom byte of each pixel,
+            // then pack 4 * 4 pixels down into 16 bytes
+            __m128i const * p = reinterpret_cast<__m128i const *>(pixels + i);
+            __m128i a = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p), count), mask);
+            __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 1), count), mask);
+            __m128i c = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 2), count), mask);
+            __m128i d = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 3), count), mask);
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+        }
+        extract_channel_scalar(pixels + i, out + i, n - i, shift);
+    }
+
+    __attribute__((target("sse2")))
+    std::size_t find_change_sse2(std::uint8_t const * row, std::size_t from, std::size_t n)
+    {
+        std::size_t i = from;
+        for (; (i + 16) <= n; i += 16)
+        {
+            // Compare 16 values at once against their left-hand neighbours
+            __m128i cur = _mm_loadu_si128(reinterpret_cast<__m128i const *>(row + i));
+            __m128i prev = _mm_loadu_si128(reinterpret_cast<__m128i const *>(row + i - 1));
+            unsigned same = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(cur, prev)));
+            if (same != 0xffffu)
+                return i + __builtin_ctz(~same);
+        }
+        return find_change_scalar(row, i, n);
+    }
+
+    __attribute__((target("avx2")))
+    void extract_channel_avx2(std::uint32_t const * pixels, std::uint8_t * out, std::size_t n, unsigned shift)
+    {
+        __m128i const count = _mm_cvtsi32_si128(static_cast<int>(shift));
+        __m256i const mask = _mm256_set1_epi32(0xff);
+        // Packing works within 128-bit lanes; this puts the results back
+        // into pixel order afterwards
+        __m256i const order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        std::size_t i = 0;
+        for (; (i + 32) <= n; i += 32)
+        {
+            __m256i const * p = reinterpret_cast<__m256i const *>(pixels + i);
+            __m256i a = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(p), count), mask);
+            __m256i b = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(p + 1), count), mask);
+            __m256i c = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(p + 2), count), mask);
+            __m256i d = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(p + 3), count), mask);
+            __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_permutevar8x32_epi32(packed, order));
+        }
+        extract_channel_sse2(pixels + i, out + i, n - i, shift);
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t find_change_avx2(std::uint8_t const * row, std::size_t from, std::size_t n)
+    {
+        std::size_t i = from;
+        for (; (i + 32) <= n; i += 32)
+        {
+            __m256i cur = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(row + i));
+            __m256i prev = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(row + i - 1));
+            unsigned same = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, prev)));
+            if (same != 0xffffffffu)
+                return i + __builtin_ctz(~same);
+        }
+        return find_change_sse2(row, i, n);
+    }
+#endif
+
+    struct Implementation
+    {
+        void (*extract_channel)(std::uint32_t const *, std::uint8_t *, std::size_t, unsigned);
+        std::size_t (*find_change)(std::uint8_t const *, std::size_t, std::size_t);
+    };
+
+    Implementation const & implementation()
+    {
+        static Implementation const impl = []
+        {
+#ifdef HAVE_X86_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return Implementation{extract_channel_avx2, find_change_avx2};
+            if (__builtin_cpu_supports("sse2"))
+                return Implementation{extract_channel_sse2, find_change_sse2};
+#endif
+            return Implementation{extract_channel_scalar, find_change_scalar};
+        }();
+        return impl;
+    }
+}
+
+void extract_channel(std::uint32_t const * pixels, std::uint8_t * out, std::size_t n, unsigned shift)
+{
+    implementation().extract_channel(pixels, out, n, shift);
+}
+
+std::size_t find_change(std::uint8_t const * row, std::size_t from, std::size_t n)
+{
+    return implementation().find_change(row, from, n);
+}
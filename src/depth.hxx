@@ -0,0 +1,34 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_DEPTH_HXX
+#define TEXT_TO_STEREOGRAM_DEPTH_HXX
+
+#include <cstddef>
+#include <cstdint>
+
+// Helpers for scanning rows of depth values. These pick the fastest
+// implementation the CPU supports (AVX2, SSE2, or plain C++) the first time
+// they are called.
+
+// Extract one 8-bit colour channel from a row of n 32-bit pixels, given the
+// channel's bit shift within each pixel
+void extract_channel(std::uint32_t const * pixels, std::uint8_t * out, std::size_t n, unsigned shift);
+
+// Return the first index i in [from, n) at which row[i] != row[i - 1], or n if
+// the row is constant from there onwards. from must be at least 1.
+std::size_t find_change(std::uint8_t const * row, std::size_t from, std::size_t n);
+
+#endif
@@ -0,0 +1,666 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL.h>
+#include <zlib.h>
+
+#include "formats.hxx"
+
+namespace
+{
+    int rawwidth = 0;
+    int rawheight = 0;
+    int pnglevel = -1;
+
+    bool little_endian()
+    {
+        std::uint32_t const one = 1;
+        std::uint8_t little;
+        std::memcpy(&little, &one, 1);
+        return little != 0;
+    }
+
+    // Lower-cased extension of a file name, without the dot
+    std::string extension(char const * filename)
+    {
+        char const * dot = std::strrchr(filename, '.');
+        if (!dot || std::strchr(dot, '/'))
+            return std::string();
+        std::string ext(dot + 1);
+        for (char & c : ext)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return ext;
+    }
+
+    // Reads the whitespace-separated header fields of PNM & PAM files,
+    // skipping comments
+    class HeaderReader
+    {
+        public:
+            HeaderReader(std::uint8_t const * data, std::size_t size)
+                : data(data), size(size)
+            {
+            }
+
+            // Skip whitespace and comments, but not newlines if lines is set
+            void skip(bool lines = false)
+            {
+                while (pos < size)
+                {
+                    if (data[pos] == '#')
+                    {
+                        while ((pos < size) && (data[pos] != '\n'))
+                            ++pos;
+                    }
+                    else if (std::isspace(data[pos]) && !(lines && (data[pos] == '\n')))
+                        ++pos;
+                    else
+                        break;
+                }
+            }
+
+            std::string word()
+            {
+                skip();
+                std::size_t const start = pos;
+                while ((pos < size) && !std::isspace(data[pos]))
+                    ++pos;
+                return std::string(reinterpret_cast<char const *>(data) + start, pos - start);
+            }
+
+            // Non-negative decimal number, or -1 if there isn't one
+            long number()
+            {
+                skip();
+                long n = -1;
+                for (; (pos < size) && std::isdigit(data[pos]) && (n < 1000000000); ++pos)
+                    n = ((n < 0) ? 0 : (n * 10)) + (data[pos] - '0');
+                if ((pos < size) && !std::isspace(data[pos]) && (data[pos] != '#'))
+                    return -1;
+                return n;
+            }
+
+            // Rest of the current line
+            std::string line()
+            {
+                skip(true);
+                std::size_t const start = pos;
+                while ((pos < size) && (data[pos] != '\n'))
+                    ++pos;
+                return std::string(reinterpret_cast<char const *>(data) + start, pos - start);
+            }
+
+            // Consume the single whitespace character which ends a header
+            bool end()
+            {
+                if ((pos >= size) || !std::isspace(data[pos]))
+                    return false;
+                ++pos;
+                return true;
+            }
+
+            std::size_t offset() const
+            {
+                return pos;
+            }
+
+        private:
+            std::uint8_t const * data;
+            std::size_t size;
+            std::size_t pos = 0;
+    };
+
+    std::uint32_t big_endian32(std::uint8_t const * p)
+    {
+        return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16)
+            | (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    void put_big_endian32(std::uint8_t * p, std::uint32_t v)
+    {
+        p[0] = static_cast<std::uint8_t>(v >> 24);
+        p[1] = static_cast<std::uint8_t>(v >> 16);
+        p[2] = static_cast<std::uint8_t>(v >> 8);
+        p[3] = static_cast<std::uint8_t>(v);
+    }
+
+    // Compressed data is added to a band this many bytes at a time
+    std::size_t const growth = 1 << 16;
+
+    // Largest PNG chunk written: the format allows up to 2^31 - 1 bytes
+    std::size_t const maxchunk = 1 << 30;
+}
+
+void set_raw_size(int w, int h)
+{
+    rawwidth = w;
+    rawheight = h;
+}
+
+void set_png_level(int level)
+{
+    pnglevel = level;
+}
+
+MappedImage::~MappedImage()
+{
+    close();
+}
+
+void MappedImage::close()
+{
+    if (mapping)
+        munmap(mapping, size);
+    mapping = nullptr;
+    size = 0;
+    pixels = nullptr;
+    w = h = 0;
+}
+
+bool MappedImage::recognised(char const * filename)
+{
+    std::string const ext = extension(filename);
+    return (ext == "pgm") || (ext == "ppm") || (ext == "pnm") || (ext == "pam")
+        || (ext == "ff") || (ext == "raw") || (ext == "gray");
+}
+
+bool MappedImage::open(char const * filename)
+{
+    close();
+    int const fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        SDL_SetError("Couldn't open %s: %s", filename, std::strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0))
+    {
+        ::close(fd);
+        SDL_SetError("Couldn't read %s", filename);
+        return false;
+    }
+    size = static_cast<std::size_t>(st.st_size);
+    mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        SDL_SetError("Couldn't map %s into memory: %s", filename, std::strerror(errno));
+        return false;
+    }
+    std::uint8_t const * const data = static_cast<std::uint8_t const *>(mapping);
+
+    std::string const ext = extension(filename);
+    std::size_t header = 0;
+    if ((ext == "raw") || (ext == "gray"))
+    {
+        if ((rawwidth <= 0) || (rawheight <= 0))
+        {
+            SDL_SetError("The size of raw depth maps must be given");
+            return false;
+        }
+        std::uint64_t const n = static_cast<std::uint64_t>(rawwidth) * rawheight;
+        if ((size != n) && (size != (n * 2)))
+        {
+            SDL_SetError("Raw depth map is neither 8 nor 16 bits per pixel at %dx%d", rawwidth, rawheight);
+            return false;
+        }
+        w = rawwidth;
+        h = rawheight;
+        channels = 1;
+        bytes = static_cast<int>(size / n);
+        maxval = (bytes == 1) ? 255 : 65535;
+        bigendian = !little_endian();
+        alpha = false;
+    }
+    else if (ext == "ff")
+    {
+        if ((size < 16) || (std::memcmp(data, "farbfeld", 8) != 0)
+                || (big_endian32(data + 8) > INT32_MAX) || (big_endian32(data + 12) > INT32_MAX))
+        {
+            SDL_SetError("Not a farbfeld image");
+            return false;
+        }
+        header = 16;
+        w = static_cast<int>(big_endian32(data + 8));
+        h = static_cast<int>(big_endian32(data + 12));
+        channels = 4;
+        bytes = 2;
+        maxval = 65535;
+        bigendian = true;
+        alpha = true;
+    }
+    else
+    {
+        // PNM: "P5" (grey) or "P6" (RGB), width, height & maximum value.
+        // PAM: "P7", then lines of "KEY value" up to "ENDHDR".
+        HeaderReader reader(data, size);
+        std::string const magic = reader.word();
+        long width = -1;
+        long height = -1;
+        long depth = -1;
+        long max = -1;
+        if ((magic == "P5") || (magic == "P6"))
+        {
+            width = reader.number();
+            height = reader.number();
+            max = reader.number();
+            depth = (magic == "P5") ? 1 : 3;
+            if (!reader.end())
+                max = -1;
+        }
+        else if (magic == "P7")
+        {
+            for (std::string key = reader.word(); key != "ENDHDR"; key = reader.word())
+            {
+                if (key == "WIDTH")
+                    width = reader.number();
+                else if (key == "HEIGHT")
+                    height = reader.number();
+                else if (key == "DEPTH")
+                    depth = reader.number();
+                else if (key == "MAXVAL")
+                    max = reader.number();
+                else if (key == "TUPLTYPE")
+                    reader.line();
+                else
+                {
+                    max = -1;
+                    break;
+                }
+            }
+            if (!reader.end())
+                max = -1;
+        }
+        if ((width <= 0) || (width > INT32_MAX) || (height <= 0) || (height > INT32_MAX)
+                || (depth < 1) || (depth > 4) || (max < 1) || (max > 65535))
+        {
+            SDL_SetError("Not a binary PNM or PAM image, or not one that is supported");
+            return false;
+        }
+        header = reader.offset();
+        w = static_cast<int>(width);
+        h = static_cast<int>(height);
+        channels = static_cast<int>(depth);
+        maxval = static_cast<std::uint32_t>(max);
+        bytes = (maxval < 256) ? 1 : 2;
+        bigendian = true;
+        alpha = (channels == 2) || (channels == 4);
+    }
+
+    stride = static_cast<std::size_t>(w) * channels * bytes;
+    if ((static_cast<std::uint64_t>(stride) * h) > (size - header))
+    {
+        SDL_SetError("Image data is truncated");
+        return false;
+    }
+    pixels = data + header;
+    return true;
+}
+
+stereogram::Image MappedImage::image() const
+{
+    stereogram::Image image = {nullptr, w, h, static_cast<std::ptrdiff_t>(stride), stereogram::PixelFormat::Grey8};
+    std::uintptr_t const address = reinterpret_cast<std::uintptr_t>(pixels);
+    if ((channels == 1) && (bytes == 1) && (maxval == 255))
+        image.pixels = const_cast<std::uint8_t *>(pixels);
+    else if ((channels == 1) && (maxval == 65535) && (bigendian != little_endian()) && ((address % 2) == 0))
+    {
+        image.pixels = const_cast<std::uint8_t *>(pixels);
+        image.format = stereogram::PixelFormat::Grey16;
+    }
+    else if ((channels == 4) && (maxval == 255) && ((address % 4) == 0))
+    {
+        image.pixels = const_cast<std::uint8_t *>(pixels);
+        image.format = stereogram::PixelFormat::RGBA32;
+    }
+    return image;
+}
+
+std::uint32_t MappedImage::channel(std::uint8_t const * row, int x, int c) const
+{
+    std::uint8_t const * p = row + ((static_cast<std::size_t>(x) * channels + c) * bytes);
+    std::uint32_t const v = (bytes == 1) ? p[0] : (bigendian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]));
+    return ((std::min(v, maxval) * 65535) + (maxval / 2)) / maxval;
+}
+
+void MappedImage::depth_row(int y, std::uint8_t * out) const
+{
+    std::uint8_t const * row = pixels + (stride * y);
+    if ((channels == 1) && (bytes == 1) && (maxval == 255))
+    {
+        std::copy(row, row + w, out);
+        return;
+    }
+    for (int x = 0; x < w; ++x)
+    {
+        std::uint32_t v = channel(row, x, 0);
+        if (alpha)
+            v = ((v * channel(row, x, channels - 1)) + 32767) / 65535;
+        out[x] = static_cast<std::uint8_t>(((v * 255) + 32767) / 65535);
+    }
+}
+
+void MappedImage::depth_row(int y, float * out) const
+{
+    std::uint8_t const * row = pixels + (stride * y);
+    for (int x = 0; x < w; ++x)
+    {
+        float v = channel(row, x, 0) / 65535.0f;
+        if (alpha)
+            v *= channel(row, x, channels - 1) / 65535.0f;
+        out[x] = v;
+    }
+}
+
+void MappedImage::argb_row(int y, std::uint32_t * out) const
+{
+    std::uint8_t const * row = pixels + (stride * y);
+    int const colour = (channels >= 3) ? 3 : 1;
+    for (int x = 0; x < w; ++x)
+    {
+        // ARGB32: bytes in A, R, G, B order in memory
+        std::uint8_t * dst = reinterpret_cast<std::uint8_t *>(out + x);
+        dst[0] = alpha ? static_cast<std::uint8_t>(((channel(row, x, channels - 1) * 255) + 32767) / 65535) : 255;
+        for (int c = 0; c < 3; ++c)
+            dst[c + 1] = static_cast<std::uint8_t>(((channel(row, x, (colour == 3) ? c : 0) * 255) + 32767) / 65535);
+    }
+}
+
+ImageWriter::~ImageWriter()
+{
+    if (file && !standard)
+        std::fclose(file);
+}
+
+bool ImageWriter::open(char const * filename, int w, int h)
+{
+    standard = (std::strcmp(filename, "-") == 0);
+    std::string const ext = standard ? std::string("raw") : extension(filename);
+    file = standard ? stdout : std::fopen(filename, "wb");
+    if (!file)
+    {
+        SDL_SetError("Couldn't open %s for writing: %s", filename, std::strerror(errno));
+        return false;
+    }
+    rowbytes = static_cast<std::size_t>(w) * 4;
+    height = h;
+    if (ext == "pam")
+    {
+        if (std::fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", w, h) < 0)
+        {
+            SDL_SetError("Error writing %s: %s", filename, std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    if ((ext == "raw") || (ext == "rgba"))
+        return true;
+
+    // 8-bit RGBA, not interlaced. Stereograms repeat along each row, which
+    // zlib finds for itself; row filters only hide the repeats, making output
+    // bigger as well as slower, so every row has filter type 0 (none).
+    png = true;
+    level = (pnglevel >= 0) ? pnglevel : Z_DEFAULT_COMPRESSION;
+    static std::uint8_t const signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::uint8_t header[13] = {};
+    put_big_endian32(header, static_cast<std::uint32_t>(w));
+    put_big_endian32(header + 4, static_cast<std::uint32_t>(h));
+    header[8] = 8;
+    header[9] = 6;
+    if ((std::fwrite(signature, 1, sizeof(signature), file) != sizeof(signature))
+            || !write_chunk("IHDR", header, sizeof(header)))
+    {
+        SDL_SetError("Error writing %s: %s", filename, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool ImageWriter::open_strip(char const * filename, int w, int h, int first, int last)
+{
+    standard = (std::strcmp(filename, "-") == 0);
+    file = standard ? stdout : std::fopen(filename, "wb");
+    if (!file)
+    {
+        SDL_SetError("Couldn't open %s for writing: %s", filename, std::strerror(errno));
+        return false;
+    }
+    rowbytes = static_cast<std::size_t>(w) * 4;
+    height = last - first;
+    if (std::fprintf(file, "STEREOGRAM-STRIP\nWIDTH %d\nHEIGHT %d\nROWS %d %d\nENDHDR\n", w, h, first, last) < 0)
+    {
+        SDL_SetError("Error writing %s: %s", filename, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool ImageWriter::write(std::uint8_t const * row)
+{
+    if (png)
+    {
+        // Compress rows a band at a time
+        pending.insert(pending.end(), row, row + rowbytes);
+        int const n = static_cast<int>(pending.size() / rowbytes);
+        if ((((next + n) % bandrows) != 0) && ((next + n) < height))
+            return true;
+        bool const ok = encode(band, next, n, pending.data(), rowbytes) && write(band);
+        pending.clear();
+        next += n;
+        return ok;
+    }
+    if (std::fwrite(row, 1, rowbytes, file) != rowbytes)
+    {
+        if (standard)
+            SDL_SetError("Unable to write to standard output");
+        else
+            SDL_SetError("Error writing image: %s", std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool ImageWriter::encode(Band & band, int first, int n, std::uint8_t const * rows, std::size_t stride) const
+{
+    band.last = ((first + n) >= height);
+    if (!png)
+    {
+        band.data.resize(rowbytes * n);
+        for (int y = 0; y < n; ++y)
+            std::memcpy(band.data.data() + (rowbytes * y), rows + (stride * y), rowbytes);
+        band.rawbytes = band.data.size();
+        return true;
+    }
+
+    // Raw deflate, with the zlib header added to the first band and the
+    // checksum after the last one by hand
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        SDL_SetError("Unable to start compressing image");
+        return false;
+    }
+    band.rawbytes = static_cast<std::uint64_t>(rowbytes + 1) * n;
+    band.data.clear();
+    if (first == 0)
+    {
+        // Compression method 8 (deflate) with a 32K window, and a level
+        // which is only informative; the header must be a multiple of 31
+        int const flevel = (level == Z_DEFAULT_COMPRESSION) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+        unsigned const bits = 0x7800 | (flevel << 6);
+        band.data.push_back(0x78);
+        band.data.push_back(static_cast<std::uint8_t>((bits & 0xff) + (31 - (bits % 31)) % 31));
+    }
+    // Compressed data goes on the end of band.data as it comes, so that it
+    // only takes up as much room as it needs
+    auto compress = [&](std::uint8_t const * in, std::size_t size, int flush)
+    {
+        stream.next_in = const_cast<std::uint8_t *>(in);
+        stream.avail_in = static_cast<uInt>(size);
+        for (;;)
+        {
+            if (stream.avail_out == 0)
+            {
+                std::size_t const used = band.data.size();
+                band.data.resize(used + growth);
+                stream.next_out = band.data.data() + used;
+                stream.avail_out = static_cast<uInt>(growth);
+            }
+            int const status = deflate(&stream, flush);
+            if (status == Z_STREAM_END)
+                return true;
+            if ((status != Z_OK) && (status != Z_BUF_ERROR))
+                return false;
+            if ((flush != Z_FINISH) && (stream.avail_in == 0) && (stream.avail_out != 0))
+                return true;
+        }
+    };
+    std::uint8_t const filter = 0;
+    uLong check = adler32(0, nullptr, 0);
+    bool ok = true;
+    for (int y = 0; ok && (y < n); ++y)
+    {
+        std::uint8_t const * row = rows + (stride * y);
+        check = adler32(check, &filter, 1);
+        check = adler32(check, row, static_cast<uInt>(rowbytes));
+        ok = compress(&filter, 1, Z_NO_FLUSH) && compress(row, rowbytes, Z_NO_FLUSH);
+    }
+    // Bands before the last end on a byte boundary without ending the
+    // stream. The last has room left for the checksum.
+    ok = ok && compress(nullptr, 0, band.last ? Z_FINISH : Z_SYNC_FLUSH);
+    band.data.resize((band.data.size() - stream.avail_out) + (band.last ? 4 : 0));
+    deflateEnd(&stream);
+    band.check = static_cast<std::uint32_t>(check);
+    if (!ok)
+        SDL_SetError("Unable to compress image");
+    return ok;
+}
+
+bool ImageWriter::write(Band & band)
+{
+    if (!png)
+    {
+        std::size_t const n = band.data.size();
+        if (std::fwrite(band.data.data(), 1, n, file) != n)
+        {
+            if (standard)
+                SDL_SetError("Unable to write to standard output");
+            else
+                SDL_SetError("Error writing image: %s", std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    check = static_cast<std::uint32_t>(adler32_combine(check, band.check, static_cast<z_off_t>(band.rawbytes)));
+    if (band.last)
+        put_big_endian32(band.data.data() + (band.data.size() - 4), check);
+    for (std::size_t done = 0; done < band.data.size(); done += maxchunk)
+    {
+        if (!write_chunk("IDAT", band.data.data() + done, std::min(maxchunk, band.data.size() - done)))
+        {
+            SDL_SetError("Error writing image: %s", std::strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ImageWriter::write_chunk(char const * type, std::uint8_t const * data, std::size_t n)
+{
+    std::uint8_t header[8];
+    put_big_endian32(header, static_cast<std::uint32_t>(n));
+    std::memcpy(header + 4, type, 4);
+    uLong crc = crc32(0, header + 4, 4);
+    if (n > 0)
+        crc = crc32(crc, data, static_cast<uInt>(n));
+    std::uint8_t trailer[4];
+    put_big_endian32(trailer, static_cast<std::uint32_t>(crc));
+    return (std::fwrite(header, 1, 8, file) == 8) && ((n == 0) || (std::fwrite(data, 1, n, file) == n))
+        && (std::fwrite(trailer, 1, 4, file) == 4);
+}
+
+bool ImageWriter::finish()
+{
+    if (png && !write_chunk("IEND", nullptr, 0))
+    {
+        SDL_SetError("Error writing image: %s", std::strerror(errno));
+        return false;
+    }
+    if (standard)
+    {
+        if (std::fflush(stdout) != 0)
+        {
+            SDL_SetError("Unable to write to standard output");
+            return false;
+        }
+        return true;
+    }
+    std::FILE * f = file;
+    file = nullptr;
+    if (std::fclose(f) != 0)
+    {
+        SDL_SetError("Error writing image: %s", std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+StripReader::~StripReader()
+{
+    if (file)
+        std::fclose(file);
+}
+
+bool StripReader::open(char const * filename)
+{
+    file = std::fopen(filename, "rb");
+    if (!file)
+    {
+        SDL_SetError("Couldn't open %s: %s", filename, std::strerror(errno));
+        return false;
+    }
+    // The header ends with a single newline, straight before the pixels
+    if ((std::fscanf(file, "STEREOGRAM-STRIP WIDTH %d HEIGHT %d ROWS %d %d ENDHDR", &w, &h, &firstrow, &lastrow) != 4)
+            || (std::fgetc(file) != '\n') || (w <= 0) || (h <= 0) || (firstrow < 0) || (firstrow >= lastrow) || (lastrow > h))
+    {
+        SDL_SetError("%s is not a valid strip", filename);
+        return false;
+    }
+    return true;
+}
+
+bool StripReader::read(std::uint8_t * row)
+{
+    std::size_t const rowbytes = static_cast<std::size_t>(w) * 4;
+    if (std::fread(row, 1, rowbytes, file) != rowbytes)
+    {
+        SDL_SetError("Strip is truncated");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,229 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_FORMATS_HXX
+#define TEXT_TO_STEREOGRAM_FORMATS_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "stereogram.hxx"
+
+// Image formats which need no decoding, for getting pixels in and out as fast
+// as the disk allows. Input files in these formats are memory-mapped, and
+// their pixels used where they lie whenever the renderer can read them as
+// they are. Which format a file is in comes from its extension; anything not
+// recognised here is left to SDL_image (for input) or written as PNG (for
+// output). Functions which can fail return false, with the reason available
+// from SDL_GetError().
+
+// Size of headerless raw depth maps (.raw or .gray), which have no header to
+// say. Whether they have one byte per pixel, or two in native byte order, is
+// told from the file size.
+void set_raw_size(int w, int h);
+
+// zlib compression level for PNG output, from 0 (none) to 9 (smallest), or
+// -1 for zlib's default. Lower levels are much faster to write.
+void set_png_level(int level);
+
+// An image in one of the uncompressed input formats, mapped into memory:
+//   - PGM, PPM or PNM (.pgm, .ppm, .pnm): binary grey or RGB
+//   - PAM (.pam): grey or RGB, either with or without alpha
+//   - farbfeld (.ff): 16-bit RGBA
+//   - headerless raw (.raw or .gray): 8 or 16-bit grey, see set_raw_size()
+// with up to 16 bits per channel.
+class MappedImage
+{
+    public:
+        MappedImage() = default;
+        MappedImage(MappedImage const &) = delete;
+        MappedImage & operator=(MappedImage const &) = delete;
+        ~MappedImage();
+
+        // Whether the file name has the extension of one of the formats
+        static bool recognised(char const * filename);
+
+        bool open(char const * filename);
+
+        int width() const
+        {
+            return w;
+        }
+
+        int height() const
+        {
+            return h;
+        }
+
+        // Whether channels have more than 8 bits
+        bool high_depth() const
+        {
+            return bytes == 2;
+        }
+
+        // The pixels as they lie in the file, if the renderer can read them
+        // directly: 8-bit grey, 16-bit grey in native byte order, or 8-bit
+        // RGBA. Otherwise, pixels is null.
+        stereogram::Image image() const;
+
+        // Depth values of row y: the grey or red channel, as if blitted onto
+        // black, either rounded to 0 .. 255, or from 0.0 to 1.0
+        void depth_row(int y, std::uint8_t * out) const;
+        void depth_row(int y, float * out) const;
+
+        // Row y as ARGB32 pixels
+        void argb_row(int y, std::uint32_t * out) const;
+
+    private:
+        // Channel c of pixel x in row y, scaled to 0 .. 65535
+        std::uint32_t channel(std::uint8_t const * row, int x, int c) const;
+        void close();
+
+        void * mapping = nullptr;
+        std::size_t size = 0;
+        std::uint8_t const * pixels = nullptr;
+        std::size_t stride = 0;
+        int w = 0;
+        int h = 0;
+        int channels = 0;
+        int bytes = 0;
+        std::uint32_t maxval = 0;
+        bool bigendian = false;
+        bool alpha = false;
+};
+
+// Writes an RGBA image, in a format chosen from the file name: PAM (.pam),
+// headerless raw 8-bit RGBA (.raw or .rgba, or standard output for "-"), or
+// otherwise PNG. Rows are written either one at a time, or in bands encoded
+// beforehand. A PNG's image data is a single zlib stream, but each band is
+// compressed on its own, finishing on a byte boundary, so that the pieces
+// can simply be joined together: bands can be compressed on several threads
+// at once, while later rows are still being rendered.
+class ImageWriter
+{
+    public:
+        // A band of consecutive rows, ready to go in the file
+        struct Band
+        {
+            std::vector<std::uint8_t> data;
+            // Adler-32 checksum of the rows as they are compressed, for the
+            // end of the zlib stream
+            std::uint32_t check = 1;
+            std::uint64_t rawbytes = 0;
+            bool last = false;
+        };
+
+        // PNGs are compressed in bands of this many rows, starting from the
+        // top, whichever way the rows are handed over, so that the file
+        // depends only on the image
+        static constexpr int bandrows = 64;
+
+        ImageWriter() = default;
+        ImageWriter(ImageWriter const &) = delete;
+        ImageWriter & operator=(ImageWriter const &) = delete;
+        ~ImageWriter();
+
+        // Create the file and write the header for a w x h image
+        bool open(char const * filename, int w, int h);
+
+        // As above, but for just rows [first, last) of the image, written as
+        // a strip (see StripReader) whatever the file name
+        bool open_strip(char const * filename, int w, int h, int first, int last);
+
+        // Write the next row, as 8-bit RGBA
+        bool write(std::uint8_t const * row);
+
+        // Encode rows [first, first + n) of the image, given as 8-bit RGBA
+        // with rows stride bytes apart, into band. For PNGs, that must be one
+        // whole band of bandrows rows (or the rest of the image). Only reads
+        // the writer's settings, so may be called on several threads at once.
+        bool encode(Band & band, int first, int n, std::uint8_t const * rows, std::size_t stride) const;
+
+        // Write the next band from encode(), in order, after any rows before
+        // it. Fills in the end of the zlib stream in the last band.
+        bool write(Band & band);
+
+        bool finish();
+
+    private:
+        bool write_chunk(char const * type, std::uint8_t const * data, std::size_t n);
+
+        std::FILE * file = nullptr;
+        bool standard = false;
+        bool png = false;
+        int level = 0;
+        int height = 0;
+        std::size_t rowbytes = 0;
+        // Checksum of the zlib stream so far
+        std::uint32_t check = 1;
+        // PNGs written a row at a time are still compressed in bands
+        std::vector<std::uint8_t> pending;
+        int next = 0;
+        Band band;
+};
+
+// Reads a strip: rows [first, last) of a w x h image, rendered separately
+// from the rest, e.g. on another machine, to be merged back into the whole.
+// Strips have a short text header:
+//   STEREOGRAM-STRIP
+//   WIDTH <w>
+//   HEIGHT <h>
+//   ROWS <first> <last>
+//   ENDHDR
+// followed by the rows, as raw 8-bit RGBA.
+class StripReader
+{
+    public:
+        StripReader() = default;
+        StripReader(StripReader const &) = delete;
+        StripReader & operator=(StripReader const &) = delete;
+        ~StripReader();
+
+        bool open(char const * filename);
+
+        int width() const
+        {
+            return w;
+        }
+
+        int height() const
+        {
+            return h;
+        }
+
+        int first() const
+        {
+            return firstrow;
+        }
+
+        int last() const
+        {
+            return lastrow;
+        }
+
+        // Read the next row, as 8-bit RGBA
+        bool read(std::uint8_t * row);
+
+    private:
+        std::FILE * file = nullptr;
+        int w = 0;
+        int h = 0;
+        int firstrow = 0;
+        int lastrow = 0;
+};
+
+#endif
@@ -0,0 +1,215 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <SDL_image.h>
+
+#include "depth.hxx"
+#include "images.hxx"
+
+bool load_tile(char const * filename, Tile & tile)
+{
+    tile.mapped.reset();
+    if (MappedImage::recognised(filename))
+    {
+        auto mapped = std::make_shared<MappedImage>();
+        if (!mapped->open(filename))
+            return false;
+        // Every pixel in the tile must have an index which fits in 32 bits
+        if ((static_cast<std::uint64_t>(mapped->width()) * mapped->height()) > UINT32_MAX)
+        {
+            SDL_SetError("Tile image too big; max. 2^32 pixels");
+            return false;
+        }
+        tile.w = mapped->width();
+        tile.h = mapped->height();
+        stereogram::Image const image = mapped->image();
+        if (image.pixels && (image.format == stereogram::PixelFormat::RGBA32))
+        {
+            tile.pixels.clear();
+            tile.mapped = mapped;
+            return true;
+        }
+        tile.pixels.resize(static_cast<std::size_t>(tile.w) * tile.h);
+        for (int y = 0; y < tile.h; ++y)
+            mapped->argb_row(y, tile.pixels.data() + (static_cast<std::size_t>(y) * tile.w));
+        return true;
+    }
+
+    SDL_Surface * tilesurface = IMG_Load(filename);
+    if (!tilesurface)
+        return false;
+    // Every pixel in the tile must have an index which fits in 32 bits
+    if ((static_cast<std::uint64_t>(tilesurface->w) * tilesurface->h) > UINT32_MAX)
+    {
+        SDL_FreeSurface(tilesurface);
+        SDL_SetError("Tile image too big; max. 2^32 pixels");
+        return false;
+    }
+
+    // Convert tile image to output pixel format
+    if (tilesurface->format->format != SDL_PIXELFORMAT_ARGB32)
+    {
+        auto old = tilesurface;
+        tilesurface = SDL_ConvertSurfaceFormat(old, SDL_PIXELFORMAT_ARGB32, 0);
+        SDL_FreeSurface(old);
+        if (!tilesurface)
+            return false;
+    }
+
+    // Take a tightly packed copy of the tile pixels
+    tile.w = tilesurface->w;
+    tile.h = tilesurface->h;
+    tile.pixels.resize(static_cast<std::size_t>(tile.w) * tile.h);
+    for (int y = 0; y < tile.h; ++y)
+    {
+        std::uint32_t const * src = reinterpret_cast<std::uint32_t const *>(
+                static_cast<std::uint8_t const *>(tilesurface->pixels) + (tilesurface->pitch * y));
+        std::copy(src, src + tile.w, tile.pixels.begin() + (static_cast<std::size_t>(y) * tile.w));
+    }
+    SDL_FreeSurface(tilesurface);
+    return true;
+}
+
+SDL_Surface * render_text(TTF_Font * font, char const * text, int depth)
+{
+    std::uint8_t d = static_cast<std::uint8_t>(depth);
+    return TTF_RenderUTF8_Solid(font, text, {d, d, d, 255});
+}
+
+SDL_Surface * create_canvas(int w, int h)
+{
+    SDL_Surface * canvas = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB32);
+    if (!canvas)
+        return nullptr;
+    // We make assumptions later that we can treat canvas->pixels as uint32_t*
+    if (canvas->format->BytesPerPixel != 4)
+    {
+        SDL_SetError("Unsuitable format for window-sized surface: %d bytes per pixel", canvas->format->BytesPerPixel);
+        SDL_FreeSurface(canvas);
+        return nullptr;
+    }
+    return canvas;
+}
+
+bool clear_plane(DepthPlane & plane, int w, int h)
+{
+    try
+    {
+        plane.values.assign(static_cast<std::size_t>(w) * h, 0);
+    }
+    catch (std::bad_alloc const &)
+    {
+        plane.values = std::vector<std::uint8_t>();
+        plane.w = plane.h = 0;
+        SDL_SetError("Not enough memory for a %dx%d depth plane", w, h);
+        return false;
+    }
+    plane.w = w;
+    plane.h = h;
+    return true;
+}
+
+bool place_depth(DepthPlane & plane, SDL_Surface * depthsurface, int w, int h, int tilew)
+{
+    if (!clear_plane(plane, w, h))
+        return false;
+    if (!depthsurface)
+        return true;
+    // Blit onto black at its own size first, so that palettes, colour keys
+    // and alpha come out the same as they would blitted anywhere else
+    SDL_Surface * argb = SDL_CreateRGBSurfaceWithFormat(0, depthsurface->w, depthsurface->h, 32, SDL_PIXELFORMAT_ARGB32);
+    if (!argb)
+        return false;
+    SDL_FillRect(argb, nullptr, 0);
+    if (SDL_BlitSurface(depthsurface, nullptr, argb, nullptr) != 0)
+    {
+        SDL_FreeSurface(argb);
+        return false;
+    }
+    int const ox = ((w / 2) - (depthsurface->w / 2)) + (tilew / 2);
+    int const oy = (h / 2) - (depthsurface->h / 2);
+    int const first = std::max(0, -ox);
+    int const last = std::min(depthsurface->w, w - ox);
+    for (int y = std::max(0, -oy); (y < depthsurface->h) && ((oy + y) < h) && (first < last); ++y)
+    {
+        std::uint32_t const * src = reinterpret_cast<std::uint32_t const *>(
+                static_cast<std::uint8_t const *>(argb->pixels) + (argb->pitch * y));
+        extract_channel(src + first, plane.values.data() + ((static_cast<std::size_t>(oy + y) * w) + ox + first),
+                last - first, argb->format->Rshift);
+    }
+    SDL_FreeSurface(argb);
+    return true;
+}
+
+stereogram::Image canvas_image(SDL_Surface * canvas)
+{
+    return {canvas->pixels, canvas->w, canvas->h, canvas->pitch, stereogram::PixelFormat::ARGB32};
+}
+
+stereogram::Options canvas_options(bool cross, double l)
+{
+    stereogram::Options options;
+    options.cross = cross;
+    options.divisor = l;
+    options.centre = false;
+    return options;
+}
+
+bool save_canvas(SDL_Surface * canvas, char const * filename, std::vector<std::uint8_t> & buffer)
+{
+    ImageWriter writer;
+    if (!writer.open(filename, canvas->w, canvas->h))
+        return false;
+    SDL_PixelFormat const * format = canvas->format;
+    buffer.resize(static_cast<std::size_t>(canvas->w) * 4);
+    for (int y = 0; y < canvas->h; ++y)
+    {
+        std::uint32_t const * src = reinterpret_cast<std::uint32_t const *>(
+                static_cast<std::uint8_t const *>(canvas->pixels) + (static_cast<std::ptrdiff_t>(canvas->pitch) * y));
+        std::uint8_t * dst = buffer.data();
+        for (int x = 0; x < canvas->w; ++x, dst += 4)
+        {
+            dst[0] = static_cast<std::uint8_t>((src[x] & format->Rmask) >> format->Rshift);
+            dst[1] = static_cast<std::uint8_t>((src[x] & format->Gmask) >> format->Gshift);
+            dst[2] = static_cast<std::uint8_t>((src[x] & format->Bmask) >> format->Bshift);
+            dst[3] = static_cast<std::uint8_t>((src[x] & format->Amask) >> format->Ashift);
+        }
+        if (!writer.write(buffer.data()))
+            return false;
+    }
+    return writer.finish();
+}
+
+std::uint64_t hash_row(std::uint8_t const * row, std::size_t n)
+{
+    std::uint64_t hash = 0xcbf29ce484222325u ^ n;
+    std::size_t i = 0;
+    for (; (i + 8) <= n; i += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, row + i, 8);
+        hash = (hash ^ word) * 0x100000001b3u;
+        hash ^= hash >> 29;
+    }
+    for (; i < n; ++i)
+        hash = (hash ^ row[i]) * 0x100000001b3u;
+    return hash;
+}
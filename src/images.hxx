@@ -0,0 +1,102 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_IMAGES_HXX
+#define TEXT_TO_STEREOGRAM_IMAGES_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <SDL.h>
+#include <SDL_ttf.h>
+
+#include "formats.hxx"
+#include "stereogram.hxx"
+
+// Glue between SDL surfaces and the rendering library. Functions which can
+// fail return false or nullptr, with the reason available from SDL_GetError().
+
+// Tile image, as tightly packed ARGB32 pixels, or 8-bit RGBA pixels used
+// where they lie in a mapped file
+struct Tile
+{
+    int w = 0;
+    int h = 0;
+    std::vector<std::uint32_t> pixels;
+    std::shared_ptr<MappedImage const> mapped;
+
+    // The library only ever reads tiles
+    stereogram::Image image() const
+    {
+        if (mapped)
+            return mapped->image();
+        return {const_cast<std::uint32_t *>(pixels.data()), w, h, w * 4, stereogram::PixelFormat::ARGB32};
+    }
+};
+
+// Load a tile image, converted to ARGB32 unless it is uncompressed 8-bit RGBA
+bool load_tile(char const * filename, Tile & tile);
+
+// Render text to use as a depth map, at the given depth (1 = far, 255 = near)
+SDL_Surface * render_text(TTF_Font * font, char const * text, int depth);
+
+// Depth values for every pixel of the output, one byte each, with the depth
+// map already in place. Built once per depth map, and only ever read while
+// rendering.
+struct DepthPlane
+{
+    int w = 0;
+    int h = 0;
+    std::vector<std::uint8_t> values;
+
+    stereogram::Image image() const
+    {
+        return {const_cast<std::uint8_t *>(values.data()), w, h, w, stereogram::PixelFormat::Grey8};
+    }
+};
+
+// Hash of a row of depth values, used to spot rows which have not changed
+// between renders. The length is mixed in, so a row of zeros has no special
+// hash; the preview looks for those itself.
+std::uint64_t hash_row(std::uint8_t const * row, std::size_t n);
+
+// Create an ARGB32 surface to render a stereogram into
+SDL_Surface * create_canvas(int w, int h);
+
+// Size a depth plane for a w x h output, with every value 0. Returns false if
+// there isn't enough memory.
+bool clear_plane(DepthPlane & plane, int w, int h);
+
+// Fill a w x h depth plane from the depth map: centred, but shifted right by
+// half a tile width to account for the unmodified tile strip at the
+// left-hand edge. The red channel of the depth map is used as depth, as it
+// would look blitted onto black. With no depth map, the plane is all zero.
+// Returns false if the depth map couldn't be converted.
+bool place_depth(DepthPlane & plane, SDL_Surface * depthsurface, int w, int h, int tilew);
+
+// The pixels of a canvas, for rendering into
+stereogram::Image canvas_image(SDL_Surface * canvas);
+
+// Options for rendering with the depth map already placed in a depth plane
+stereogram::Options canvas_options(bool cross, double l);
+
+// Save the canvas in the format given by the file name's extension (see
+// ImageWriter), or write it to standard output as raw, 8-bit RGBA pixels for
+// "-". buffer is somewhere to convert rows of pixels.
+bool save_canvas(SDL_Surface * canvas, char const * filename, std::vector<std::uint8_t> & buffer);
+
+#endif
@@ -14,12 +14,19 @@
 // with this program. If not, see <https://www.gnu.org/licenses/>. 
 
 #include <algorithm>
-#include <chrono>
+#include <atomic>
+#include <cctype>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <getopt.h>
@@ -28,41 +35,19 @@
 #include <SDL_image.h>
 #include <SDL_ttf.h>
 
+#include "formats.hxx"
+#include "images.hxx"
+#include "preview.hxx"
+#include "server.hxx"
+#include "stats.hxx"
+#include "stream.hxx"
+#include "text.hxx"
+
 SDL_Renderer * renderer = nullptr;
-SDL_Surface * gradientsurface = nullptr;
-SDL_Surface * offsetsurface = nullptr;
-SDL_Surface * rearrsurface = nullptr;
 SDL_Surface * depthsurface = nullptr;
-SDL_Surface * tilesurface = nullptr;
 SDL_Surface * windowsurface = nullptr;
-SDL_Texture * texture = nullptr;
 TTF_Font * font = nullptr;
 
-void free_rearrsurface()
-{
-    SDL_FreeSurface(rearrsurface);
-}
-
-void free_offsetsurface()
-{
-    SDL_FreeSurface(offsetsurface);
-}
-
-void free_gradientsurface()
-{
-    SDL_FreeSurface(gradientsurface);
-}
-
-void destroy_texture()
-{
-    SDL_DestroyTexture(texture);
-}
-
-void free_tilesurface()
-{
-    SDL_FreeSurface(tilesurface);
-}
-
 void free_windowsurface()
 {
     SDL_FreeSurface(windowsurface);
@@ -85,167 +70,138 @@ void close_font()
 
 void usage()
 {
-    std::cerr << "Usage: text-to-stereogram -t <tile> [-c] [-w <width>] [-h <height>] [-o <output file>] [-f <font> [-s <size> -d <depth>] <string>] [-m <depth map>] [-l <pattern length divisor>]\n";
+    std::cerr << "Usage: text-to-stereogram -t <tile> [-c] [-w <width>] [-h <height>] [-o <output file> [-p]] [-f <font> [-s <size> -d <depth>] <string>] [-m <depth map>] [-l <pattern length divisor>] [-j <threads>] [-n <first frame>:<last frame>]\n";
+    std::cerr << "       text-to-stereogram -t <tile> -f <font> -b <strings file> -o <output file> [-c] [-w <width>] [-h <height>] [-s <size>] [-d <depth>] [-l <pattern length divisor>] [-j <threads>]\n";
+    std::cerr << "       text-to-stereogram -S [-j <threads>]\n";
+    std::cerr << "       text-to-stereogram --batch <manifest> [-j <threads>]\n";
+    std::cerr << "       text-to-stereogram --merge -o <output file> <strip files>...\n";
+    std::cerr << "Either form also accepts --stats=json [--stats-file=<file>], --png-level=<0-9> and --raw-size=<width>x<height>.\n";
     std::cerr << "Specify -f and <string> to render text, -m to render geometry.\n";
+    std::cerr << "With -o, the image is rendered off-screen, saved, and the program exits; add -p to also preview it in a window.\n";
+    std::cerr << "Use -o - to write raw RGBA pixels to standard output.\n";
+    std::cerr << "Images ending .pgm, .ppm, .pnm, .pam, .ff (farbfeld), .raw or .gray are read without decoding; .raw and .gray need --raw-size.\n";
+    std::cerr << "Output ending .pam is written as PAM, and .raw or .rgba as raw RGBA; anything else is PNG, compressed at --png-level.\n";
+    std::cerr << "With -n, -m and -o are file name patterns containing a frame number, e.g. depth%04d.png.\n";
+    std::cerr << "With -b, one image is rendered per line of the file (- for standard input), and -o contains a line number, e.g. out%04d.png.\n";
+    std::cerr << "With -S, render requests read from standard input, one JSON object per line, until it is closed.\n";
+    std::cerr << "With --rows=<first>:<last>, only those rows (first inclusive, last exclusive) are rendered, to a strip file for --merge.\n";
+    std::cerr << "With --batch, every line of the manifest (- for standard input) is one image's options, as above.\n";
+    std::cerr << "With --stats=json, timings & counters are written to standard error, or the --stats-file, when done.\n";
 }
 
-void draw(SDL_Surface * srcsurface, bool init, int row, bool cross, double l)
+// Check that a file name pattern for an image sequence contains exactly one
+// frame number (e.g. "depth%04d.png"), and nothing else printf would expand
+bool valid_frame_pattern(char const * pattern)
 {
-    SDL_SetSurfaceBlendMode(windowsurface, SDL_BLENDMODE_NONE);
-    SDL_SetSurfaceBlendMode(srcsurface, SDL_BLENDMODE_NONE);
+    int frames = 0;
+    for (char const * c = pattern; *c != '\0'; ++c)
+    {
+        if (*c != '%')
+            continue;
+        if (*(++c) == '%')
+            continue;
+        while (std::isdigit(static_cast<unsigned char>(*c)))
+            ++c;
+        if (*c != 'd')
+            return false;
+        ++frames;
+    }
+    return frames == 1;
+}
 
-    if (init)
+std::string frame_name(char const * pattern, int frame)
+{
+    std::vector<char> name(std::strlen(pattern) + 64);
+    std::snprintf(name.data(), name.size(), pattern, frame);
+    return name.data();
+}
+
+// Write statistics gathered while rendering, if asked to
+bool write_stats(bool stats, char const * statsfile)
+{
+    if (!stats)
+        return true;
+    if (statsfile == nullptr)
     {
-        std::srand(42);
-        // Blit depth map to the image
-        {
-            SDL_Rect dst = {((windowsurface->w / 2) - (depthsurface->w / 2)) + (srcsurface->w / 2), (windowsurface->h / 2) - (depthsurface->h / 2), 0, 0};
-            SDL_BlitSurface(depthsurface, nullptr, windowsurface, &dst);
-        }
+        stats::write_json(std::cerr);
+        return true;
+    }
+    std::ofstream out(statsfile);
+    stats::write_json(out);
+    if (!out)
+    {
+        std::cerr << "Unable to write statistics to " << statsfile << std::endl;
+        return false;
     }
+    return true;
+}
 
-    if (row < 0)
+// Render one image per line of the named file, or standard input for "-"
+int render_batch(char const * batchname, char const * fontname, int s, int d, Tile const & tile,
+        char const * outfname, int w, int h, bool cross, double l, unsigned jobs)
+{
+    std::ifstream file;
+    if (std::strcmp(batchname, "-") != 0)
     {
-        // We're doing all rows
-        // Blit one strip of tile image to window-sized surface
-        for (int y = 0; y < windowsurface->h; y += srcsurface->h)
+        file.open(batchname);
+        if (!file)
         {
-            SDL_Rect dst = {0, y, 0, 0};
-            SDL_BlitSurface(srcsurface, nullptr, windowsurface, &dst);
+            std::cerr << "Unable to open " << batchname << std::endl;
+            return 1;
         }
     }
-    else
-    {
-        // Blit just the current row of the tile image to the surface
-        int y = row;
-        while (y >= srcsurface->h)
-            y -= srcsurface->h;
-        SDL_Rect src = {0, y, srcsurface->w, 1};
-        SDL_Rect dst = {0, row, 0, 0};
-        SDL_BlitSurface(srcsurface, &src, windowsurface, &dst);
-    }
-
-    // Depth disparity coefficient: we want to normalise the depth range so
-    // that the pattern doesn't get down to one pixel or anything ridiculous
-    // (unless that's what the user claims they want).
-    // With a monochrome depthmap we get 256 discrete depth steps; work out
-    // how many pixels of pattern length change each step represents. To stop
-    // the pattern length degenerating to something silly like 1 pixel, first
-    // divide the pattern length by the pattern length divisor. A divisor of
-    // 2 means the pattern will shorten by up to half its original length, a
-    // divisor of 4 means it will only shorten by up to a quarter of its
-    // original length.
-    double c = (static_cast<double>(srcsurface->w) / l) / 256.0;
-    // Render the actual stereogram, row by row
-    int y = 0, ylimit = windowsurface->h;
-    if (row >= 0)
-    {
-        y = row;
-        ylimit = row + 1;
-    }
-    for (; y < ylimit; ++y)
-    {
-        // State: previous depthbuffer value, current repeating pattern, pattern length.
-        // Copy current row of initial tile into pattern.
-        uint32_t prev = 0;
-        std::uint32_t * start =
-            reinterpret_cast<std::uint32_t*>(
-                    static_cast<std::uint8_t*>(windowsurface->pixels) + (windowsurface->pitch * y));
-        std::uint32_t * end = start + srcsurface->w;
-        std::vector<std::uint32_t> pattern(start, end);
-        // Keep length as double, as we may be adjusting it by fractions of a pixel,
-        // and don't want shallow slopes to get lost in rounding errors that never
-        // end up altering the integer pattern length.
-        double len = static_cast<double>(pattern.size());
-        // Iterator to current pattern position
-        auto pattern_it = pattern.begin();
-        // Iterate over remainder of row
-        for (int x = srcsurface->w; x < windowsurface->w; ++x)
-        {
-            // Grab one single colour component from current pixel
-            std::uint32_t current = *(start + x);
-            current &= windowsurface->format->Rmask;
-            current >>= windowsurface->format->Rshift;
-            current <<= windowsurface->format->Rloss;
-            // Shorten or lengthen pattern accordingly.
-            // In wall-eyed mode: shorten when pixels get nearer; lengthen for further.
-            // In cross-eyed mode: lengthen when pixels get further; shorten for nearer.
-            // NB: The comparisons look the wrong way round because we assume inverted
-            // depth maps, i.e. 0 is the far plane, 255 near.
-            if (cross ? (current < prev) : (current > prev))
-            {
-                // Shorten the pattern.
-                std::uint32_t disparity = cross ? (prev - current) : (current - prev);
-                double d = static_cast<double>(disparity) * c;
-                double newlen = len - d;
-                disparity = static_cast<std::uint32_t>(pattern.size() - std::lround(newlen));
-                // We may need to wrap around the end of the pattern buffer
-                if (disparity > (pattern.end() - pattern_it))
-                {
-                    auto to_end = pattern.end() - pattern_it;
-                    pattern.erase(pattern_it, pattern.end());
-                    auto remaining = disparity - to_end;
-                    unsigned offset = (pattern_it - pattern.begin()) - remaining;
-                    pattern.erase(pattern.begin(), pattern.begin() + remaining);
-                    while (offset >= pattern.size())
-                        offset -= pattern.size();
-                    pattern_it = pattern.begin() + offset;
-                }
-                else
-                {
-                    unsigned offset = pattern_it - pattern.begin();
-                    pattern.erase(pattern_it, pattern_it + disparity);
-                    while (offset >= pattern.size())
-                        offset -= pattern.size();
-                    pattern_it = pattern.begin() + offset;
-                }
-                len = newlen;
-            }
-            else if (cross ? (current > prev) : (current < prev))
-            {
-                // Lengthen the pattern.
-                std::uint32_t disparity = cross ? (current - prev) : (prev - current);
-                double d = static_cast<double>(disparity) * c;
-                double newlen = len + d;
-                disparity = static_cast<std::uint32_t>(std::lround(newlen) - pattern.size());
-                len = newlen;
-                auto offset = (pattern_it - pattern.begin());
-                // Insert pixels from 1 to 5 rows above in the tile.
-                // This randomness helps alleviate artefacts resulting from
-                // accidentally introducing additional repeating patterns
-                // if depth keeps alternating between two values.
-                int py = y - ((std::rand() / ((RAND_MAX + 1u) / 5)) + 1);
-                if (py < 0)
-                    py += srcsurface->h;
-                else
-                    while (py >= srcsurface->h)
-                        py -= srcsurface->h;
-                std::uint32_t px = x;
-                while (px >= static_cast<std::uint32_t>(srcsurface->w))
-                    px -= srcsurface->w;
-                // We may need to wrap around edge of tile
-                // Insert pixels up to edge of tile
-                std::uint32_t * p =
-                    reinterpret_cast<std::uint32_t*>(
-                            static_cast<std::uint8_t*>(srcsurface->pixels) + (srcsurface->pitch * py))
-                    + px;
-                pattern.insert(pattern_it, p, p + std::min(disparity, srcsurface->w - px));
-                pattern_it = pattern.begin() + offset;
-                if (disparity > (srcsurface->w - px))
-                {
-                    disparity -= (srcsurface->w - px);
-                    p -= px;
-                    pattern.insert(pattern_it + 1 + (srcsurface->w - px), p, p + disparity);
-                }
-                pattern_it = pattern.begin() + offset;
-            }
-            // Write current pattern pixel to surface
-            *(start + x) = *pattern_it;
-            prev = current;
-            if (++pattern_it == pattern.end())
-                pattern_it = pattern.begin();
+    std::istream & in = file.is_open() ? file : std::cin;
+    GlyphAtlas atlas;
+    std::string text;
+    for (int number = 1; std::getline(in, text); ++number)
+    {
+        if (!text.empty() && (text.back() == '\r'))
+            text.pop_back();
+        if (text.empty())
+            continue;
+        BatchLine line;
+        line.font = fontname;
+        line.size = s;
+        line.depth = d;
+        if (!parse_batch_line(text, line))
+        {
+            std::cerr << "Line " << number << ": " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        SDL_Surface * surface;
+        {
+            stats::Timer timer(stats::Stage::RenderText);
+            surface = atlas.render(line.font, line.size, line.text, line.depth);
+        }
+        if (!surface)
+        {
+            std::cerr << "Line " << number << ": Unable to render text surface: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        if ((w < (tile.w * 2)) || (((w - (tile.w * 2))) < surface->w))
+        {
+            std::cerr << "Line " << number << ": Warning: Image not wide enough! Should be at least " << ((tile.w * 2) + surface->w) << std::endl;
+        }
+        std::string const output = !line.output.empty() ? line.output
+            : ((std::strcmp(outfname, "-") == 0) ? std::string(outfname) : frame_name(outfname, number));
+        bool ok;
+        {
+            DepthReader depth;
+            ok = depth.open(surface) && render_stream(output.c_str(), depth, tile, w, h, cross, l, jobs);
+        }
+        SDL_FreeSurface(surface);
+        if (!ok)
+        {
+            std::cerr << "Line " << number << ": Unable to save image: " << SDL_GetError() << std::endl;
+            return 1;
         }
     }
+    if (in.bad())
+    {
+        std::cerr << "Unable to read " << batchname << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char * argv[])
@@ -262,11 +218,44 @@ int main(int argc, char * argv[])
     char const * depthname = nullptr;
     char const * text = "Hello, world!";
     bool cross = false;
+    bool preview = false;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool sequence = false;
+    int firstframe = 0;
+    int lastframe = 0;
+    bool server = false;
+    bool stats = false;
+    char const * statsfile = nullptr;
+    char const * batchname = nullptr;
+    char const * manifestname = nullptr;
+    int firstrow = 0;
+    int lastrow = -1;
+    bool merge = false;
 
     // Parse command-line options
     {
+        enum
+        {
+            StatsOption = 256,
+            StatsFileOption,
+            RawSizeOption,
+            PngLevelOption,
+            BatchOption,
+            RowsOption,
+            MergeOption
+        };
+        static option const longoptions[] = {
+            {"stats", required_argument, nullptr, StatsOption},
+            {"stats-file", required_argument, nullptr, StatsFileOption},
+            {"raw-size", required_argument, nullptr, RawSizeOption},
+            {"png-level", required_argument, nullptr, PngLevelOption},
+            {"batch", required_argument, nullptr, BatchOption},
+            {"rows", required_argument, nullptr, RowsOption},
+            {"merge", no_argument, nullptr, MergeOption},
+            {nullptr, 0, nullptr, 0}
+        };
         int c;
-        while ((c = getopt(argc, argv, "w:h:f:s:t:o:m:cd:l:")) != -1)
+        while ((c = getopt_long(argc, argv, "w:h:f:s:t:o:m:cd:l:pj:n:Sb:", longoptions, nullptr)) != -1)
         {
             switch (c)
             {
@@ -313,6 +302,87 @@ int main(int argc, char * argv[])
                     // plane, it will be tile width divided by this.
                     l = std::atof(optarg);
                     break;
+                case 'p':
+                    // Show the output in a window even when saving to a file
+                    preview = true;
+                    break;
+                case 'j':
+                    // Number of rendering threads
+                    jobs = static_cast<unsigned>(std::max(0, std::atoi(optarg)));
+                    break;
+                case 'n':
+                    // Render a numbered sequence of depth maps
+                    sequence = true;
+                    if (std::sscanf(optarg, "%d:%d", &firstframe, &lastframe) != 2)
+                        lastframe = firstframe - 1;
+                    break;
+                case 'S':
+                    // Run as a render server
+                    server = true;
+                    break;
+                case 'b':
+                    // Render every string in a file, one per line
+                    batchname = optarg;
+                    break;
+                case StatsOption:
+                    // Report rendering statistics; JSON is the only format
+                    if (std::strcmp(optarg, "json") != 0)
+                    {
+                        usage();
+                        return 1;
+                    }
+                    if (!stats::enabled)
+                    {
+                        std::cerr << "Statistics support was not enabled when building" << std::endl;
+                        return 1;
+                    }
+                    stats = true;
+                    break;
+                case StatsFileOption:
+                    // Where to write statistics, instead of standard error
+                    statsfile = optarg;
+                    break;
+                case RawSizeOption:
+                {
+                    // Size of headerless raw depth maps
+                    int rw = 0;
+                    int rh = 0;
+                    if ((std::sscanf(optarg, "%dx%d", &rw, &rh) != 2) || (rw <= 0) || (rh <= 0))
+                    {
+                        usage();
+                        return 1;
+                    }
+                    set_raw_size(rw, rh);
+                    break;
+                }
+                case PngLevelOption:
+                {
+                    // PNG compression level: lower is faster
+                    int const level = std::atoi(optarg);
+                    if ((level < 0) || (level > 9))
+                    {
+                        usage();
+                        return 1;
+                    }
+                    set_png_level(level);
+                    break;
+                }
+                case BatchOption:
+                    // Render every job in a manifest, one per line
+                    manifestname = optarg;
+                    break;
+                case RowsOption:
+                    // Render just a strip of rows, to be merged with the rest
+                    if ((std::sscanf(optarg, "%d:%d", &firstrow, &lastrow) != 2) || (firstrow < 0) || (lastrow <= firstrow))
+                    {
+                        usage();
+                        return 1;
+                    }
+                    break;
+                case MergeOption:
+                    // Join strips rendered with --rows
+                    merge = true;
+                    break;
                 default:
                     // Unrecognised
                     usage();
@@ -320,7 +390,46 @@ int main(int argc, char * argv[])
             }
         }
     }
-    if (((fontname == nullptr) && (depthname == nullptr)) || (tilename == nullptr) || (w <= 0) || (h <= 0) || (s <= 0))
+    if (server)
+    {
+        if (jobs == 0)
+        {
+            usage();
+            return 1;
+        }
+        int status = serve(jobs);
+        if (!write_stats(stats, statsfile))
+            status = 1;
+        return status;
+    }
+    if (merge)
+    {
+        if ((outfname == nullptr) || (optind == argc))
+        {
+            usage();
+            return 1;
+        }
+        std::vector<char const *> strips(argv + optind, argv + argc);
+        if (!merge_strips(outfname, strips))
+        {
+            std::cerr << "Unable to merge strips: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (manifestname != nullptr)
+    {
+        if (jobs == 0)
+        {
+            usage();
+            return 1;
+        }
+        int status = run_manifest(manifestname, jobs);
+        if (!write_stats(stats, statsfile))
+            status = 1;
+        return status;
+    }
+    if (((fontname == nullptr) && (depthname == nullptr)) || (tilename == nullptr) || (w <= 0) || (h <= 0) || (s <= 0) || (jobs == 0))
     {
         usage();
         return 1;
@@ -344,30 +453,81 @@ int main(int argc, char * argv[])
         }
         text = argv[optind];
     }
+    if (batchname != nullptr)
+    {
+        if ((fontname == nullptr) || (depthname != nullptr) || (outfname == nullptr) || preview || sequence || (optind < argc))
+        {
+            std::cerr << "Batches need a font (-f) and an output (-o), and no depth map, preview, sequence or string" << std::endl;
+            return 1;
+        }
+        if ((std::strcmp(outfname, "-") != 0) && !valid_frame_pattern(outfname))
+        {
+            std::cerr << "Output file names for batches must contain a single line number, e.g. out%04d.png" << std::endl;
+            return 1;
+        }
+    }
+    if (lastrow >= 0)
+    {
+        if ((outfname == nullptr) || preview || sequence || (batchname != nullptr) || (lastrow > h))
+        {
+            std::cerr << "Strips need an output (-o), no preview, sequence or batch, and rows within the image" << std::endl;
+            return 1;
+        }
+    }
+    if (sequence)
+    {
+        if ((depthname == nullptr) || (outfname == nullptr) || (lastframe < firstframe))
+        {
+            std::cerr << "Sequences need a depth map (-m), an output (-o), and a valid frame range (-n)" << std::endl;
+            return 1;
+        }
+        if (!valid_frame_pattern(depthname)
+                || ((std::strcmp(outfname, "-") != 0) && !valid_frame_pattern(outfname)))
+        {
+            std::cerr << "File names for sequences must contain a single frame number, e.g. depth%04d.png" << std::endl;
+            return 1;
+        }
+    }
+
+    // When saving to a file, run entirely off-screen unless a preview was
+    // explicitly requested: no video subsystem, window or renderer.
+    bool const headless = (outfname != nullptr) && !preview;
+    // Single images rendered off-screen are streamed out a strip at a time,
+    // so only ever need a few rows of the output in memory.
+    bool const streaming = headless && !sequence && (batchname == nullptr);
+    // Depth maps with more than 8 bits of precision are read directly, rather
+    // than through an 8-bit surface, and rendered with sub-pixel precision
+    bool const highdepth = (depthname != nullptr) && !sequence && DepthReader::is_high_depth(depthname);
+    // Uncompressed depth maps are always read directly, from memory
+    bool const mapped = (depthname != nullptr) && MappedImage::recognised(depthname);
+    bool const readdepth = streaming || highdepth || mapped;
 
     // Init SDL
-    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+    if (SDL_Init(headless ? 0 : SDL_INIT_VIDEO) != 0)
     {
         std::cerr << "Unable to initialise SDL: " << SDL_GetError() << std::endl;
         return 1;
     }
     std::atexit(SDL_Quit);
-    auto window = SDL_CreateWindow(
-            "text-to-stereogram",
-            SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-            w, h, SDL_WINDOW_SHOWN);
-    if (!window)
+    if (!headless)
     {
-        std::cerr << "Unable to create window: " << SDL_GetError() << std::endl;
-        return 1;
-    }
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-    if (!renderer)
-    {
-        std::cerr << "Unable to create renderer: " << SDL_GetError() << std::endl;
-        return 1;
+        auto window = SDL_CreateWindow(
+                "text-to-stereogram",
+                SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                w, h, SDL_WINDOW_SHOWN);
+        if (!window)
+        {
+            std::cerr << "Unable to create window: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+        if (!renderer)
+        {
+            std::cerr << "Unable to create renderer: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        std::atexit(destroy_renderer);
     }
-    std::atexit(destroy_renderer);
 
     // Init SDL_image
     if (IMG_Init(0) != 0)
@@ -377,6 +537,19 @@ int main(int argc, char * argv[])
     }
     std::atexit(IMG_Quit);
 
+    // Load the tile image while the depth map is loaded or rendered
+    Tile tile;
+    std::string tileerror;
+    std::future<bool> tileloaded = std::async(std::launch::async, [&]
+    {
+        stats::Timer timer(stats::Stage::LoadTile);
+        if (load_tile(tilename, tile))
+            return true;
+        // Errors are kept per thread
+        tileerror = IMG_GetError();
+        return false;
+    });
+
     if (depthname == nullptr)
     {
         // Init SDL_ttf
@@ -386,25 +559,32 @@ int main(int argc, char * argv[])
             return 1;
         }
         std::atexit(TTF_Quit);
-        if (!(font = TTF_OpenFont(fontname, s)))
-        {
-            std::cerr << "Unable to open font: " << TTF_GetError() << std::endl;
-            return 1;
-        }
-        std::atexit(close_font);
-        // Render text
-        std::uint8_t depth = static_cast<std::uint8_t>(d);
-        depthsurface = TTF_RenderUTF8_Solid(font, text, {depth, depth, depth});
-        if (!depthsurface)
+        // Batches open fonts as they go
+        if (batchname == nullptr)
         {
-            std::cerr << "Unable to render text surface: " << TTF_GetError() << std::endl;
-            return 1;
+            if (!(font = TTF_OpenFont(fontname, s)))
+            {
+                std::cerr << "Unable to open font: " << TTF_GetError() << std::endl;
+                return 1;
+            }
+            std::atexit(close_font);
+            // Render text
+            {
+                stats::Timer timer(stats::Stage::RenderText);
+                depthsurface = render_text(font, text, d);
+            }
+            if (!depthsurface)
+            {
+                std::cerr << "Unable to render text surface: " << TTF_GetError() << std::endl;
+                return 1;
+            }
         }
     }
-    else
+    else if (!readdepth)
     {
         // Load custom depth map
-        depthsurface = IMG_Load(depthname);
+        stats::Timer timer(stats::Stage::LoadDepth);
+        depthsurface = IMG_Load(sequence ? frame_name(depthname, firstframe).c_str() : depthname);
         if (!depthsurface)
         {
             std::cerr << "Unable to load depth map image: " << IMG_GetError() << std::endl;
@@ -412,202 +592,205 @@ int main(int argc, char * argv[])
         }
     }
     std::atexit(free_depthsurface);
+    DepthReader depthreader;
+    std::vector<float> highdepthmap;
+    if (readdepth)
+    {
+        stats::Timer timer(stats::Stage::LoadDepth);
+        if (!(depthsurface ? depthreader.open(depthsurface)
+                    : depthreader.open(sequence ? frame_name(depthname, firstframe).c_str() : depthname)))
+        {
+            std::cerr << "Unable to load depth map image: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        // Without streaming, read high-precision depth in up front
+        if (highdepth && !streaming)
+        {
+            std::size_t const width = static_cast<std::size_t>(depthreader.width());
+            highdepthmap.resize(width * depthreader.height());
+            for (int y = 0; y < depthreader.height(); ++y)
+            {
+                if (!depthreader.read(highdepthmap.data() + (width * y)))
+                {
+                    std::cerr << "Unable to load depth map image: " << SDL_GetError() << std::endl;
+                    return 1;
+                }
+            }
+        }
+    }
 
-    // Load tile image
-    tilesurface = IMG_Load(tilename);
-    if (!tilesurface)
+    if (!tileloaded.get())
     {
-        std::cerr << "Unable to load tile image: " << IMG_GetError() << std::endl;
+        std::cerr << "Unable to load tile image: " << tileerror << std::endl;
         return 1;
     }
-    std::atexit(free_tilesurface);
-    if ((tilesurface->w > 65536) || (tilesurface->h > 65536))
+
+    // We make assumptions later that the image will be at least as wide & tall as the tile
+    if ((w < tile.w) || (h < tile.h))
     {
-        std::cerr << "Tile image too big; max. dimensions 65536*65536" << std::endl;
+        std::cerr << "Image must be at least as big as the tile in both dimensions" << std::endl;
         return 1;
     }
 
-    // Create a surface the same size as the window
-    windowsurface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB32);
-    if (!windowsurface)
+    if (batchname != nullptr)
     {
-        std::cerr << "Unable to create window-sized surface: " << SDL_GetError() << std::endl;
-        return 1;
+        int status = render_batch(batchname, fontname, s, d, tile, outfname, w, h, cross, l, jobs);
+        if (!write_stats(stats, statsfile))
+            status = 1;
+        return status;
     }
-    std::atexit(free_windowsurface);
-    // We make assumptions later that we can treat windowsurface->pixels as uint32_t*
-    if (windowsurface->format->BytesPerPixel != 4)
+
+    // Check we have enough horizontal space. One tile width each side of the depth image.
+    int const depthw = readdepth ? depthreader.width() : depthsurface->w;
+    if ((w < (tile.w * 2)) || (((w - (tile.w * 2))) < depthw))
     {
-        std::cerr << "Unsuitable format for window-sized surface: "
-            << windowsurface->format->BytesPerPixel << " bytes per pixel" << std::endl;
-        return 1;
+        std::cerr << "Warning: Image not wide enough! Should be at least " << ((tile.w * 2) + depthw) << std::endl;
     }
 
-    // Convert tile image to windowsurface pixel format
-    if ((tilesurface->format->format != windowsurface->format->format)
-            || (tilesurface->format->format == SDL_PIXELFORMAT_UNKNOWN))
+    if (streaming)
     {
-        auto old = tilesurface;
-        tilesurface = SDL_ConvertSurface(old, windowsurface->format, 0);
-        if (!tilesurface)
+        if (!render_stream(outfname, depthreader, tile, w, h, cross, l, jobs, firstrow, lastrow))
         {
-            std::cerr << "Unable to convert tile surface format: " << SDL_GetError() << std::endl;
+            std::cerr << "Unable to save image: " << SDL_GetError() << std::endl;
             return 1;
         }
-        SDL_FreeSurface(old);
+        return write_stats(stats, statsfile) ? 0 : 1;
     }
 
-    // Render a simple x/y gradient grid.
-    // Split x & y coordinates over two colour components each, so we can have
-    // max. values of 256*256 = 65536, supporting up to 65536*65536 tiles.
-    gradientsurface = SDL_CreateRGBSurfaceWithFormat(0, tilesurface->w, tilesurface->h, 32, SDL_PIXELFORMAT_ARGB32);
-    if (!gradientsurface)
+    // Create a surface the same size as the window to render into, and a
+    // plane of depth values for it with the depth map in place
+    windowsurface = create_canvas(w, h);
+    if (!windowsurface)
     {
-        std::cerr << "Unable to create offset surface: " << SDL_GetError() << std::endl;
+        std::cerr << "Unable to create window-sized surface: " << SDL_GetError() << std::endl;
         return 1;
     }
-    std::atexit(free_gradientsurface);
-    for (int y = 0; y < gradientsurface->h; ++y)
+    std::atexit(free_windowsurface);
+    DepthPlane depthplane;
+    if (!highdepth)
     {
-        std::uint32_t * pixel =
-            reinterpret_cast<std::uint32_t*>(
-                    static_cast<std::uint8_t*>(gradientsurface->pixels) + (gradientsurface->pitch * y));
-        for (int x = 0; x < gradientsurface->w; ++x, ++pixel)
+        stats::Timer timer(stats::Stage::PlaceDepth);
+        if (!(mapped ? place_depth(depthplane, depthreader, w, h, tile.w)
+                    : place_depth(depthplane, depthsurface, w, h, tile.w)))
         {
-            int a = x >> 8;
-            int r = x - (a << 8);
-            int g = y >> 8;
-            int b = y - (g << 8);
-            *(pixel) = SDL_MapRGBA(gradientsurface->format, r, g, b, a);
+            std::cerr << "Unable to place depth map: " << SDL_GetError() << std::endl;
+            return 1;
         }
     }
 
-    // We make assumptions later that the image will be at least as wide & tall as the tile
-    if ((w < tilesurface->w) || (h < tilesurface->h))
-    {
-        std::cerr << "Image must be at least as big as the tile in both dimensions" << std::endl;
-        return 1;
-    }
-
-    // Check we have enough horizontal space. One tile width each side of the depth image.
-    if ((w < (tilesurface->w * 2)) || (((w - (tilesurface->w * 2))) < depthsurface->w))
+    stereogram::Context context(jobs);
+    // For sequences: hashes of each row of depth in the previous frame, so
+    // that rows which have not changed can be left as they are in the canvas
+    // instead of rendered all over again
+    std::vector<std::uint64_t> hashes(sequence ? h : 0);
+    std::vector<std::uint64_t> previoushashes;
+    std::vector<std::uint8_t> outbuffer;
+    for (int frame = firstframe; frame <= lastframe; ++frame)
     {
-        std::cout << "Warning: Image not wide enough! Should be at least " << ((tilesurface->w * 2) + depthsurface->w) << std::endl;
-    }
-
-    draw(gradientsurface, true, -1, cross, l);
-
-    // Duplicate the original tile again, as a precursor to making the rearranged tile
-    rearrsurface = SDL_DuplicateSurface(tilesurface);
-    if (!rearrsurface)
-    {
-        std::cerr << "Unable to duplicate tile surface again: " << SDL_GetError() << std::endl;
-        return 1;
-    }
-    std::atexit(free_rearrsurface);
-
-    // Second pass: create a unique tile per row, reverse-scrambled so that it
-    // should look its least distorted in the centre of the final image.
-    offsetsurface = SDL_DuplicateSurface(windowsurface);
-    if (!offsetsurface)
-    {
-        std::cerr << "Unable to copy offset map: " << SDL_GetError() << std::endl;
-        return 1;
-    }
-    std::atexit(free_offsetsurface);
-    SDL_FillRect(windowsurface, nullptr, SDL_MapRGB(windowsurface->format, 0, 0, 0));
-    {
-        bool init = true;
-        for (int row = 0; row < offsetsurface->h; ++row)
-        {
-            // Sample offsets from tile-width region in the centre of the
-            // current row, to create a new tile which should line up with the
-            // original image:
-            //   - Start with the original tile
-            //   - R & G components in the sampled offsets tell us the X and Y
-            //     coordinates within the tile that will end up at that point
-            //   - Loop over tile, copying each pixel to the given X & Y coordinates
-            //   - When reconstructed and sampled in that order... it should reassemble
-            //     into something resembling the original image, in the centre!
-            SDL_BlitSurface(tilesurface, nullptr, rearrsurface, nullptr);
-            int i = row;
-            while (i >= tilesurface->h)
-                i -= tilesurface->h;
-            std::uint32_t* src = reinterpret_cast<std::uint32_t*>(
-                    static_cast<std::uint8_t*>(tilesurface->pixels) + (tilesurface->pitch * i));
-            std::uint32_t* off = reinterpret_cast<std::uint32_t*>(
-                    static_cast<std::uint8_t*>(offsetsurface->pixels) + (offsetsurface->pitch * row))
-                    + ((w / 2) - (tilesurface->w / 2));
-            for (int x = 0; x < tilesurface->w; ++x, ++off)
+        if (frame != firstframe)
+        {
+            SDL_FreeSurface(depthsurface);
+            depthsurface = nullptr;
+            bool loaded;
+            {
+                stats::Timer timer(stats::Stage::LoadDepth);
+                std::string const name = frame_name(depthname, frame);
+                if (mapped)
+                    loaded = depthreader.open(name.c_str());
+                else
+                    loaded = ((depthsurface = IMG_Load(name.c_str())) != nullptr);
+            }
+            if (!loaded)
             {
-                // Grab X & Y offsets from A/R & G/B colour components
-                std::uint32_t a = *off;
-                a &= offsetsurface->format->Amask;
-                a >>= offsetsurface->format->Ashift;
-                a <<= offsetsurface->format->Aloss;
-                std::uint32_t r = *off;
-                r &= offsetsurface->format->Rmask;
-                r >>= offsetsurface->format->Rshift;
-                r <<= offsetsurface->format->Rloss;
-                std::uint32_t xo = r + (a << 8);
-                std::uint32_t g = *off;
-                g &= offsetsurface->format->Gmask;
-                g >>= offsetsurface->format->Gshift;
-                g <<= offsetsurface->format->Gloss;
-                std::uint32_t b = *off;
-                b &= offsetsurface->format->Bmask;
-                b >>= offsetsurface->format->Bshift;
-                b <<= offsetsurface->format->Bloss;
-                std::uint32_t yo = b + (g << 8);
-                // Copy from coordinates in original tile to offset pixel in rearranged tile
-                std::uint32_t* dst = reinterpret_cast<std::uint32_t*>(
-                        static_cast<std::uint8_t*>(rearrsurface->pixels) + (rearrsurface->pitch * yo))
-                        + xo;
-                *dst = *(src + x);
+                std::cerr << "Unable to load depth map image: " << SDL_GetError() << std::endl;
+                return 1;
+            }
+            stats::Timer timer(stats::Stage::PlaceDepth);
+            if (!(mapped ? place_depth(depthplane, depthreader, w, h, tile.w)
+                        : place_depth(depthplane, depthsurface, w, h, tile.w)))
+            {
+                std::cerr << "Unable to place depth map: " << SDL_GetError() << std::endl;
+                return 1;
             }
-            // Render the row
-            draw(rearrsurface, init, row, cross, l);
-            init = false;
         }
-    }
 
-    // Save image if desired
-    if (outfname != nullptr)
-    {
-        if (IMG_SavePNG(windowsurface, outfname) != 0)
-            std::cerr << "Unable to save PNG: " << IMG_GetError() << std::endl;
-    }
-
-    // Prepare image for presentation
-    texture = SDL_CreateTextureFromSurface(renderer, windowsurface);
-    if (!texture)
-    {
-        std::cerr << "Unable to create texture from surface: " << SDL_GetError() << std::endl;
-        return 1;
-    }
-    std::atexit(destroy_texture);
+        // Render the stereogram. For each row, first work out which tile pixel
+        // ends up where in the output, then create a unique tile for the row,
+        // reverse-scrambled so that it should look its least distorted in the
+        // centre of the final image, and fill in the row from that.
+        {
+            stats::Timer timer(stats::Stage::Render);
+            stereogram::Image const image = canvas_image(windowsurface);
+            stereogram::Options options = canvas_options(cross, l);
+            stereogram::Image depthimage = depthplane.image();
+            if (highdepth)
+            {
+                depthimage = {highdepthmap.data(), depthreader.width(), depthreader.height(),
+                    static_cast<std::ptrdiff_t>(depthreader.width() * sizeof(float)), stereogram::PixelFormat::GreyFloat};
+                options.centre = true;
+            }
+            stereogram::RowFilter filter;
+            if (sequence)
+            {
+                // Skip rows whose depth hasn't changed since the last frame;
+                // the canvas still holds them
+                filter = [&](int row, std::uint8_t const * depth)
+                {
+                    hashes[row] = hash_row(depth, windowsurface->w);
+                    return previoushashes.empty() || (hashes[row] != previoushashes[row]);
+                };
+            }
+            if (!context.render(depthimage, tile.image(), image, options, filter))
+            {
+                std::cerr << "Unable to render: " << context.error() << std::endl;
+                return 1;
+            }
+        }
 
-    // Display image until quit
-    bool quit = false;
-    while (!quit)
-    {
-        SDL_Event e;
-        while (SDL_PollEvent(&e))
+        // Save image if desired
+        if (outfname != nullptr)
         {
-            switch (e.type)
+            stats::Timer timer(stats::Stage::Save);
+            bool const standard = (std::strcmp(outfname, "-") == 0);
+            if (!save_canvas(windowsurface, (sequence && !standard) ? frame_name(outfname, frame).c_str() : outfname, outbuffer))
             {
-                case SDL_QUIT:
-                    quit = true;
+                std::cerr << "Unable to save image: " << SDL_GetError() << std::endl;
+                if (headless || standard)
+                    return 1;
             }
         }
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-        SDL_RenderPresent(renderer);
+
+        if (sequence)
         {
-            using namespace std::chrono_literals;
-            std::this_thread::sleep_for(100ms);
+            previoushashes.swap(hashes);
+            hashes.resize(windowsurface->h);
         }
     }
+    if (!write_stats(stats, statsfile))
+        return 1;
+    if (headless)
+        return 0;
+
+    // Show the image until quit, re-rendering it as the settings are adjusted
+    PreviewScene scene;
+    scene.tile = &tile;
+    scene.font = font;
+    scene.text = text;
+    scene.plane = std::move(depthplane);
+    if (highdepth)
+    {
+        scene.map = {highdepthmap.data(), depthreader.width(), depthreader.height(),
+            static_cast<std::ptrdiff_t>(depthreader.width() * sizeof(float)), stereogram::PixelFormat::GreyFloat};
+    }
+    PreviewSettings settings;
+    settings.cross = cross;
+    settings.divisor = l;
+    settings.depth = d;
+    if (!run_preview(renderer, windowsurface, scene, settings, jobs))
+    {
+        std::cerr << "Unable to update window: " << SDL_GetError() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,151 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_PATTERN_HXX
+#define TEXT_TO_STEREOGRAM_PATTERN_HXX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The repeating pattern used when rendering a row of the stereogram.
+//
+// Conceptually this is a cyclic sequence of pixels with a cursor: the pixel
+// under the cursor is the next one to be output, after which the cursor moves
+// on by one, wrapping around at the end. Pixels are only ever removed or
+// inserted at (or just after) the cursor.
+//
+// It is stored as a ring buffer whose front is always the cursor, so reading
+// a pixel moves it from the front to the back, removing pixels just moves the
+// front forwards, and inserting pixels moves the front backwards. All of these
+// cost O(number of pixels affected), independent of the pattern length, and
+// once enough capacity has been reserved no further allocation takes place.
+//
+// Pixels are usually just tile indices, but can be anything trivially copyable.
+template <typename T> class BasicPattern
+{
+    public:
+        // Make room for a pattern of up to maxlen pixels
+        void reserve(std::size_t maxlen)
+        {
+            if ((maxlen * 2) <= buffer.size())
+                return;
+            std::size_t capacity = 16;
+            // Keep at least as much space spare as is in use, so that a whole
+            // pattern's worth of pixels can be moved from the front to the
+            // back in one go without overwriting itself
+            while (capacity < (maxlen * 2))
+                capacity *= 2;
+            std::vector<T> grown(capacity);
+            for (std::size_t i = 0; i < len; ++i)
+                grown[i] = buffer[(head + i) & mask];
+            buffer.swap(grown);
+            mask = capacity - 1;
+            head = 0;
+        }
+
+        // Replace contents with the given pixels, cursor on the first one
+        void assign(T const * first, T const * last)
+        {
+            len = 0;
+            reserve(static_cast<std::size_t>(last - first));
+            head = 0;
+            std::copy(first, last, buffer.begin());
+            len = static_cast<std::size_t>(last - first);
+        }
+
+        std::size_t size() const
+        {
+            return len;
+        }
+
+        // The pixel under the cursor, which may be modified in place
+        T & front()
+        {
+            return buffer[head];
+        }
+
+        // Return the pixel i pixels after the cursor, without moving it.
+        // i must be less than size().
+        T peek(std::size_t i) const
+        {
+            return buffer[(head + i) & mask];
+        }
+
+        // Return the pixel under the cursor and advance the cursor
+        T next()
+        {
+            T p = buffer[head];
+            buffer[(head + len) & mask] = p;
+            head = (head + 1) & mask;
+            return p;
+        }
+
+        // Copy the next n pixels to out, advancing the cursor past them.
+        // Equivalent to calling next() n times, but copies whole runs.
+        void read(T * out, std::size_t n)
+        {
+            std::size_t const capacity = buffer.size();
+            while (n > 0)
+            {
+                std::size_t const tail = (head + len) & mask;
+                std::size_t const run = std::min({n, len, capacity - head, capacity - tail});
+                std::copy(buffer.begin() + head, buffer.begin() + (head + run), out);
+                std::copy(buffer.begin() + head, buffer.begin() + (head + run), buffer.begin() + tail);
+                head = (head + run) & mask;
+                out += run;
+                n -= run;
+            }
+        }
+
+        // Remove n pixels, starting with the one under the cursor. The cursor
+        // ends up on the pixel that followed the last one removed.
+        void erase(std::size_t n)
+        {
+            head = (head + n) & mask;
+            len -= n;
+        }
+
+        // Insert pixels, such that the first one inserted ends up pos pixels
+        // after the cursor. The cursor stays pos pixels before it, i.e. with
+        // pos == 0 the cursor ends up on the first pixel inserted.
+        void insert(std::size_t pos, T const * first, T const * last)
+        {
+            std::size_t n = static_cast<std::size_t>(last - first);
+            reserve(len + n);
+            // Shuffle the pixels before the insertion point backwards
+            std::size_t const oldhead = head;
+            head = (head - n) & mask;
+            for (std::size_t i = 0; i < pos; ++i)
+                buffer[(head + i) & mask] = buffer[(oldhead + i) & mask];
+            // Copy in the new pixels, in at most two contiguous runs
+            std::size_t const to = (head + pos) & mask;
+            std::size_t const run = std::min(n, buffer.size() - to);
+            std::copy(first, first + run, buffer.begin() + to);
+            std::copy(first + run, last, buffer.begin());
+            len += n;
+        }
+
+    private:
+        std::vector<T> buffer;
+        std::size_t mask = 0;
+        std::size_t head = 0;
+        std::size_t len = 0;
+};
+
+using Pattern = BasicPattern<std::uint32_t>;
+
+#endif
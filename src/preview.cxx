@@ -0,0 +1,329 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "preview.hxx"
+
+namespace
+{
+    // The coarse preview renders every this many rows, filling in the rows
+    // between with copies until they are rendered properly
+    int const coarse = 8;
+    // The rest are rendered this many rows at a time, so that progress shows
+    // as it goes, and adjusting the settings again interrupts it promptly
+    int const chunk = 64;
+
+    // What is currently showing in a row of the canvas
+    struct RowState
+    {
+        // Signature of the row's depth values (see below); 0 if all zero
+        std::uint64_t depth = 0;
+        bool cross = false;
+        double divisor = 0.0;
+        // Copied from a nearby row as a stand-in, rather than rendered
+        bool standin = false;
+    };
+
+    void set_title(SDL_Renderer * renderer, PreviewScene const & scene, PreviewSettings const & settings)
+    {
+        char title[128];
+        if (scene.font != nullptr)
+            std::snprintf(title, sizeof(title), "text-to-stereogram: -l %g -d %d%s (%+d, %+d)",
+                    settings.divisor, settings.depth, settings.cross ? " -c" : "", settings.x, settings.y);
+        else
+            std::snprintf(title, sizeof(title), "text-to-stereogram: -l %g%s (%+d, %+d)",
+                    settings.divisor, settings.cross ? " -c" : "", settings.x, settings.y);
+        SDL_SetWindowTitle(SDL_RenderGetWindow(renderer), title);
+    }
+}
+
+bool run_preview(SDL_Renderer * renderer, SDL_Surface * canvas, PreviewScene & scene,
+        PreviewSettings settings, unsigned jobs)
+{
+    SDL_Texture * texture = SDL_CreateTextureFromSurface(renderer, canvas);
+    if (!texture)
+        return false;
+    set_title(renderer, scene, settings);
+
+    int const w = canvas->w;
+    int const h = canvas->h;
+    bool const highdepth = (scene.map.pixels != nullptr);
+    // Where the depth map's top left corner goes before it has been moved
+    int const basex = highdepth ? (((w / 2) - (scene.map.w / 2)) + (scene.tile->w / 2)) : 0;
+    int const basey = highdepth ? ((h / 2) - (scene.map.h / 2)) : 0;
+
+    // Rows with the same signature look the same whatever the settings if
+    // it is 0 (nothing in front of the far plane), and with the same divisor
+    // and eye mode otherwise. 8-bit depth is hashed; high-precision depth
+    // maps never change, so rows covering one can only change if it moves.
+    auto signature = [&](int row, std::uint8_t const * values, PreviewSettings const & s) -> std::uint64_t
+    {
+        if (values != nullptr)
+        {
+            if (std::all_of(values, values + w, [](std::uint8_t v) { return v == 0; }))
+                return 0;
+            return hash_row(values, w) | 1;
+        }
+        int const top = basey + s.y;
+        if ((row < top) || (row >= (top + scene.map.h)))
+            return 0;
+        std::uint8_t const offset[] = {
+            static_cast<std::uint8_t>(s.x), static_cast<std::uint8_t>(s.x >> 8),
+            static_cast<std::uint8_t>(s.x >> 16), static_cast<std::uint8_t>(s.x >> 24),
+            static_cast<std::uint8_t>(s.y), static_cast<std::uint8_t>(s.y >> 8),
+            static_cast<std::uint8_t>(s.y >> 16), static_cast<std::uint8_t>(s.y >> 24)
+        };
+        return hash_row(offset, sizeof(offset)) | 1;
+    };
+    std::vector<RowState> rows(h);
+    for (int row = 0; row < h; ++row)
+    {
+        std::uint8_t const * values = highdepth ? nullptr
+            : (scene.plane.values.data() + (static_cast<std::size_t>(row) * w));
+        rows[row] = {signature(row, values, settings), settings.cross, settings.divisor, false};
+    }
+
+    // Settings wanted by the window, bumping the generation every time they
+    // change, which also interrupts any render in progress
+    std::mutex mutex;
+    std::condition_variable changed;
+    PreviewSettings wanted = settings;
+    std::atomic<unsigned> generation(0);
+    bool quit = false;
+    // Held while rendering into the canvas; fresh once there's more to show
+    std::mutex canvasmutex;
+    bool fresh = false;
+
+    auto work = [&]
+    {
+        stereogram::Context context(jobs);
+        PreviewSettings current = settings;
+        unsigned done = 0;
+        std::vector<std::uint64_t> depths(h);
+        std::vector<char> todo(h);
+        for (;;)
+        {
+            PreviewSettings next;
+            unsigned gen;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return quit || (generation != done); });
+                if (quit)
+                    return;
+                next = wanted;
+                gen = done = generation;
+            }
+            auto stale = [&] { return generation != gen; };
+
+            if ((scene.font != nullptr) && (next.depth != current.depth))
+            {
+                SDL_Surface * text = render_text(scene.font, scene.text, next.depth);
+                if (!text || !place_depth(scene.plane, text, w, h, scene.tile->w))
+                    std::cerr << "Unable to render text surface: " << SDL_GetError() << std::endl;
+                SDL_FreeSurface(text);
+            }
+            current = next;
+
+            stereogram::Image const depth = highdepth ? scene.map : scene.plane.image();
+            stereogram::Image const tile = scene.tile->image();
+            stereogram::Options options = canvas_options(next.cross, next.divisor);
+            options.x = basex + next.x;
+            options.y = basey + next.y;
+            auto needed = [&](int row)
+            {
+                RowState const & state = rows[row];
+                return state.standin || (state.depth != depths[row])
+                    || ((depths[row] != 0) && ((state.cross != next.cross) || (state.divisor != next.divisor)));
+            };
+            auto rendering = [&](int row)
+            {
+                rows[row] = {depths[row], next.cross, next.divisor, false};
+                return true;
+            };
+
+            // Coarse preview: work out which rows need rendering, render
+            // every few of them, and fill the gaps with copies
+            {
+                std::lock_guard<std::mutex> lock(canvasmutex);
+                bool const rendered = context.render(depth, tile, canvas_image(canvas), options,
+                        [&](int row, std::uint8_t const * values)
+                {
+                    if (stale())
+                        return false;
+                    depths[row] = signature(row, values, next);
+                    todo[row] = needed(row);
+                    return todo[row] && ((row % coarse) == 0) && rendering(row);
+                });
+                if (!rendered)
+                {
+                    std::cerr << "Unable to render: " << context.error() << std::endl;
+                    continue;
+                }
+                if (stale())
+                    continue;
+                for (int row = 0; row < h; ++row)
+                {
+                    if (!todo[row] || ((row % coarse) == 0))
+                        continue;
+                    std::uint8_t * pixels = static_cast<std::uint8_t *>(canvas->pixels);
+                    std::copy_n(pixels + (canvas->pitch * (row - (row % coarse))), w * 4, pixels + (canvas->pitch * row));
+                    rows[row].standin = true;
+                }
+                fresh = true;
+            }
+
+            // Then render the rest properly, a chunk at a time
+            for (int top = 0; (top < h) && !stale(); top += chunk)
+            {
+                int const n = std::min(chunk, h - top);
+                if (std::none_of(todo.begin() + top, todo.begin() + top + n, [](char t) { return t != 0; }))
+                    continue;
+                stereogram::Image part = canvas_image(canvas);
+                part.pixels = static_cast<std::uint8_t *>(part.pixels) + (part.stride * top);
+                part.h = n;
+                stereogram::Options partoptions = options;
+                partoptions.top = top;
+                partoptions.y = options.y - top;
+                std::lock_guard<std::mutex> lock(canvasmutex);
+                context.render(depth, tile, part, partoptions, [&](int row, std::uint8_t const *)
+                {
+                    row += top;
+                    return !stale() && todo[row] && needed(row) && rendering(row);
+                });
+                fresh = true;
+            }
+        }
+    };
+    std::thread worker(work);
+
+    bool ok = true;
+    bool dragging = false;
+    for (bool closed = false; !closed;)
+    {
+        PreviewSettings adjusted = settings;
+        SDL_Event e;
+        // Wait for something to happen, but not for longer than a frame
+        for (bool more = SDL_WaitEventTimeout(&e, 16); more; more = SDL_PollEvent(&e))
+        {
+            switch (e.type)
+            {
+                case SDL_QUIT:
+                    closed = true;
+                    break;
+                case SDL_KEYDOWN:
+                {
+                    int const step = (e.key.keysym.mod & KMOD_SHIFT) ? 1 : 8;
+                    switch (e.key.keysym.sym)
+                    {
+                        case SDLK_ESCAPE:
+                            closed = true;
+                            break;
+                        case SDLK_LEFTBRACKET:
+                            if ((adjusted.divisor - 0.25) > 1.0)
+                                adjusted.divisor -= 0.25;
+                            break;
+                        case SDLK_RIGHTBRACKET:
+                            adjusted.divisor += 0.25;
+                            break;
+                        case SDLK_MINUS:
+                        case SDLK_KP_MINUS:
+                            if (scene.font != nullptr)
+                                adjusted.depth = std::max(1, adjusted.depth - ((step == 1) ? 1 : 5));
+                            break;
+                        case SDLK_EQUALS:
+                        case SDLK_KP_PLUS:
+                            if (scene.font != nullptr)
+                                adjusted.depth = std::min(255, adjusted.depth + ((step == 1) ? 1 : 5));
+                            break;
+                        case SDLK_c:
+                            adjusted.cross = !adjusted.cross;
+                            break;
+                        case SDLK_LEFT:
+                            adjusted.x -= step;
+                            break;
+                        case SDLK_RIGHT:
+                            adjusted.x += step;
+                            break;
+                        case SDLK_UP:
+                            adjusted.y -= step;
+                            break;
+                        case SDLK_DOWN:
+                            adjusted.y += step;
+                            break;
+                    }
+                    break;
+                }
+                case SDL_MOUSEBUTTONDOWN:
+                case SDL_MOUSEBUTTONUP:
+                    if (e.button.button == SDL_BUTTON_LEFT)
+                        dragging = (e.type == SDL_MOUSEBUTTONDOWN);
+                    break;
+                case SDL_MOUSEMOTION:
+                    if (dragging)
+                    {
+                        adjusted.x += e.motion.xrel;
+                        adjusted.y += e.motion.yrel;
+                    }
+                    break;
+            }
+        }
+        if ((adjusted.cross != settings.cross) || (adjusted.divisor != settings.divisor)
+                || (adjusted.depth != settings.depth) || (adjusted.x != settings.x) || (adjusted.y != settings.y))
+        {
+            settings = adjusted;
+            set_title(renderer, scene, settings);
+            std::lock_guard<std::mutex> lock(mutex);
+            wanted = settings;
+            ++generation;
+            changed.notify_one();
+        }
+
+        // Show whatever has been rendered so far, without waiting for the
+        // rest of it
+        if (canvasmutex.try_lock())
+        {
+            if (fresh && (SDL_UpdateTexture(texture, nullptr, canvas->pixels, canvas->pitch) != 0))
+            {
+                ok = false;
+                closed = true;
+            }
+            fresh = false;
+            canvasmutex.unlock();
+        }
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+        SDL_RenderPresent(renderer);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        ++generation;
+        changed.notify_one();
+    }
+    worker.join();
+    SDL_DestroyTexture(texture);
+    return ok;
+}
@@ -0,0 +1,65 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+
+#ifndef TEXT_TO_STEREOGRAM_PREVIEW_HXX
+#define TEXT_TO_STEREOGRAM_PREVIEW_HXX
+
+#include <SDL.h>
+#include <SDL_ttf.h>
+
+#include "images.hxx"
+#include "stereogram.hxx"
+
+// Settings which can be adjusted while previewing
+struct PreviewSettings
+{
+    bool cross = false;
+    double divisor = 2.0;
+    // Text depth (1 = far, 255 = near); only used when rendering text
+    int depth = 60;
+    // How far the depth map has been moved from where it started
+    int x = 0;
+    int y = 0;
+};
+
+// What the preview renders. With a font, the text is rendered again whenever
+// its depth is adjusted, into the depth plane. Otherwise the depth map is
+// either already in the plane, or is a high-precision map (if map.pixels
+// isn't null), centred as the library would centre it.
+struct PreviewScene
+{
+    Tile const * tile = nullptr;
+    TTF_Font * font = nullptr;
+    char const * text = nullptr;
+    DepthPlane plane;
+    stereogram::Image map;
+};
+
+// Show the canvas, already rendered from the scene with the given settings, in
+// the renderer's window until it is closed, letting the settings be adjusted:
+//   [ and ]                 pattern length divisor down & up
+//   - and =                 text depth down & up
+//   c                       switch between cross-eyed & wall-eyed
+//   arrow keys, or dragging move the depth map (with shift, a pixel at a time)
+// Changes are rendered on a background thread, using jobs rendering threads,
+// so the window stays responsive. Only rows which look different with the new
+// settings are rendered: every few rows first, as a quick, coarse preview,
+// then the rest. Returns false if the window couldn't be updated, with the
+// reason available from SDL_GetError().
+bool run_preview(SDL_Renderer * renderer, SDL_Surface * canvas, PreviewScene & scene,
+        PreviewSettings settings, unsigned jobs);
+
+#endif
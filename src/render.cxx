@@ -0,0 +1,561 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "depth.hxx"
+#include "render.hxx"
+#include "stats.hxx"
+
+namespace
+{
+    // Pattern length changes are accumulated in floating point (see below),
+    // so in general the pattern length depends on the whole history of depth
+    // values along the row. But if the disparity coefficient is a multiple of
+    // 2^-32 (as it is whenever the tile width divided by l is a multiple of
+    // 2^-24, e.g. if l is a power of two), and lengths stay below 2^20, then
+    // every sum is exact: the length at any point is just the tile width
+    // -/+ depth * coefficient, and its rounded value can be looked up.
+    void update_lengths(LengthTable & table, int tilew, double l, bool cross)
+    {
+        if ((table.tilew == tilew) && (table.l == l) && (table.cross == cross))
+            return;
+        table.tilew = tilew;
+        table.l = l;
+        table.cross = cross;
+        double const c = (static_cast<double>(tilew) / l) / 256.0;
+        double const scaled = std::ldexp(c, 32);
+        table.exact = (scaled == std::floor(scaled)) && ((tilew + (256.0 * c)) < 1048576.0);
+        for (int d = 0; d < 256; ++d)
+        {
+            double const len = cross ? (tilew + (d * c)) : (tilew - (d * c));
+            table.lengths[d] = static_cast<std::uint32_t>(std::lround(len));
+        }
+    }
+
+    void set_pixel(std::uint32_t & pixel, std::uint32_t index)
+    {
+        pixel = index;
+    }
+
+    void set_pixel(FinePixel & pixel, std::uint32_t index)
+    {
+        pixel = {index, 1.0f};
+    }
+
+    // Lengthen the pattern by disparity pixels, for output pixel x of row y.
+    // Pixels are inserted from 1 to 5 rows above in the tile.
+    // This randomness helps alleviate artefacts resulting from
+    // accidentally introducing additional repeating patterns
+    // if depth keeps alternating between two values.
+    template <typename T> void lengthen(BasicPattern<T> & pattern, std::uint32_t disparity, std::size_t x, int y,
+            int tilew, int tileh, RowRandom & rng, T * run, stats::Counters & counters)
+    {
+        int py = y - (rng.below(5) + 1);
+        if (py < 0)
+            py += tileh;
+        else
+            while (py >= tileh)
+                py -= tileh;
+        std::uint32_t px = static_cast<std::uint32_t>(x);
+        while (px >= static_cast<std::uint32_t>(tilew))
+            px -= tilew;
+        // We may need to wrap around edge of tile
+        // Insert pixels up to edge of tile
+        std::uint32_t const to_edge = tilew - px;
+        for (std::uint32_t i = 0; i < disparity; ++i)
+            set_pixel(run[i], static_cast<std::uint32_t>(py) * tilew + ((i < to_edge) ? (px + i) : (i - to_edge)));
+        pattern.insert(0, run, run + std::min(disparity, to_edge));
+        if (disparity > to_edge)
+        {
+            // The rest go in after the pixel which was under the cursor
+            pattern.insert(1 + to_edge, run + to_edge, run + disparity);
+        }
+        counters.lengthen(disparity, disparity > to_edge);
+        counters.length(pattern.size());
+    }
+
+    // Progress through a row of the stereogram, so that its tile indices can
+    // be worked out a piece at a time
+    struct RowMapping
+    {
+        explicit RowMapping(int y)
+            : rng(y)
+        {
+        }
+
+        RowRandom rng;
+        // Next output pixel to map
+        std::size_t x = 0;
+        // Depth value of the previous pixel
+        std::uint32_t prev = 0;
+        // Pattern length: kept as double, as we may be adjusting it by
+        // fractions of a pixel, and don't want shallow slopes to get lost in
+        // rounding errors that never end up altering the integer pattern
+        // length.
+        double len = 0.0;
+        stats::Counters counters;
+    };
+
+    // Start mapping row y: the first tile width of output pixels are just
+    // the current row of the tile, which also starts off the pattern
+    void start_row(RowMapping & mapping, std::uint32_t * indices, int y,
+            int tilew, int tileh, double l, Scratch & scratch)
+    {
+        auto & pattern = scratch.pattern;
+        int sy = y;
+        while (sy >= tileh)
+            sy -= tileh;
+        for (int x = 0; x < tilew; ++x)
+            indices[x] = static_cast<std::uint32_t>(sy) * tilew + x;
+        double const c = (static_cast<double>(tilew) / l) / 256.0;
+        // Longest possible pattern: full depth range of lengthening (cross-eyed)
+        pattern.reserve(tilew + static_cast<std::size_t>(std::ceil(256.0 * c)) + 1);
+        pattern.assign(indices, indices + tilew);
+        mapping.counters.length(pattern.size());
+        mapping.x = tilew;
+        mapping.len = static_cast<double>(pattern.size());
+    }
+
+    // Work out which tile pixel ends up at each position in a single row of
+    // the stereogram, storing its index within the tile
+    // (tile y * tile width + tile x) in indices, carrying on from where
+    // the mapping got to until it reaches end.
+    // With Exact, pattern lengths come from scratch.lengths instead of being
+    // tracked in floating point. Cross selects cross-eyed rather than
+    // wall-eyed viewing at compile time, so that the direction of every
+    // depth change is worked out without testing the mode each time.
+    template <bool Exact, bool Cross> void map_row(RowMapping & mapping, std::uint8_t const * depth,
+            std::uint32_t * indices, std::size_t end, int y, int tilew, int tileh, double l, Scratch & scratch)
+    {
+        auto & pattern = scratch.pattern;
+        std::uint32_t const * const lengths = scratch.lengths.lengths;
+
+        // Depth disparity coefficient: we want to normalise the depth range so
+        // that the pattern doesn't get down to one pixel or anything ridiculous
+        // (unless that's what the user claims they want).
+        // With a monochrome depthmap we get 256 discrete depth steps; work out
+        // how many pixels of pattern length change each step represents. To stop
+        // the pattern length degenerating to something silly like 1 pixel, first
+        // divide the pattern length by the pattern length divisor. A divisor of
+        // 2 means the pattern will shorten by up to half its original length, a
+        // divisor of 4 means it will only shorten by up to a quarter of its
+        // original length.
+        double c = (static_cast<double>(tilew) / l) / 256.0;
+        RowRandom & rng = mapping.rng;
+        stats::Counters & counters = mapping.counters;
+        uint32_t prev = mapping.prev;
+        double len = mapping.len;
+        std::size_t x = mapping.x;
+        while (x < end)
+        {
+            std::uint32_t current = depth[x];
+            // Shorten or lengthen pattern accordingly.
+            // In wall-eyed mode: shorten when pixels get nearer; lengthen for further.
+            // In cross-eyed mode: lengthen when pixels get further; shorten for nearer.
+            // NB: The comparisons look the wrong way round because we assume inverted
+            // depth maps, i.e. 0 is the far plane, 255 near.
+            if (Cross ? (current < prev) : (current > prev))
+            {
+                // Shorten the pattern.
+                std::uint32_t disparity = Cross ? (prev - current) : (current - prev);
+                if (Exact)
+                    disparity = static_cast<std::uint32_t>(pattern.size() - lengths[current]);
+                else
+                {
+                    double d = static_cast<double>(disparity) * c;
+                    double newlen = len - d;
+                    disparity = static_cast<std::uint32_t>(pattern.size() - std::lround(newlen));
+                    len = newlen;
+                }
+                pattern.erase(disparity);
+                counters.shorten(disparity);
+            }
+            else if (Cross ? (current > prev) : (current < prev))
+            {
+                // Lengthen the pattern.
+                std::uint32_t disparity = Cross ? (current - prev) : (prev - current);
+                if (Exact)
+                    disparity = static_cast<std::uint32_t>(lengths[current] - pattern.size());
+                else
+                {
+                    double d = static_cast<double>(disparity) * c;
+                    double newlen = len + d;
+                    disparity = static_cast<std::uint32_t>(std::lround(newlen) - pattern.size());
+                    len = newlen;
+                }
+                lengthen(pattern, disparity, x, y, tilew, tileh, rng, scratch.run.data(), counters);
+            }
+            // Record which tile pixel ends up here
+            indices[x++] = pattern.next();
+            prev = current;
+            // Pixels at the same depth as their left-hand neighbour leave the
+            // pattern unchanged, so copy out whole runs of them at once
+            if ((x < end) && (depth[x] == current))
+            {
+                std::size_t const to = find_change(depth, x + 1, end);
+                pattern.read(indices + x, to - x);
+                x = to;
+            }
+        }
+        mapping.prev = prev;
+        mapping.len = len;
+        mapping.x = x;
+    }
+
+    // As map_row(), but for fractional depth values. The pattern length
+    // changes by fractions of a pixel, so each pixel of the pattern has a
+    // width: the pattern is shortened by squashing it at the cursor, or
+    // lengthened by stretching it, and pixels are only removed or inserted
+    // once whole ones are covered. The length is always exact, so slopes come
+    // out smooth rather than in steps. Each output pixel lies somewhere
+    // between the pattern pixel under the cursor and the one after it: the
+    // tile indices of those go in scratch.indices and scratch.following, and
+    // how far between them, in 256ths, in scratch.weights.
+    template <bool Cross> void map_row_fine(float const * depth, std::size_t width, int y,
+            int tilew, int tileh, double l, Scratch & scratch)
+    {
+        auto & pattern = scratch.finepattern;
+        std::uint32_t * const indices = scratch.indices.data();
+        std::uint32_t * const following = scratch.following.data();
+        std::uint8_t * const weights = scratch.weights.data();
+        FinePixel * const run = scratch.finerun.data();
+
+        // Start with just the current row of the tile
+        {
+            int sy = y;
+            while (sy >= tileh)
+                sy -= tileh;
+            for (int x = 0; x < tilew; ++x)
+            {
+                indices[x] = following[x] = static_cast<std::uint32_t>(sy) * tilew + x;
+                run[x] = {indices[x], 1.0f};
+            }
+            std::fill(weights, weights + tilew, 0);
+        }
+
+        // Depth disparity coefficient, as in map_row()
+        double c = (static_cast<double>(tilew) / l) / 256.0;
+        RowRandom rng(y);
+        float prev = 0.0f;
+        pattern.reserve(tilew + static_cast<std::size_t>(std::ceil(256.0 * c)) + 1);
+        pattern.assign(run, run + tilew);
+        stats::Counters counters;
+        counters.length(pattern.size());
+        // How far the cursor is into the pixel under it
+        double offset = 0.0;
+        for (std::size_t x = tilew; x < width; ++x)
+        {
+            float const current = depth[x];
+            if (current != prev)
+            {
+                double change = (Cross ? (current - prev) : (prev - current)) * c;
+                prev = current;
+                if (change < 0.0)
+                {
+                    // Shorten the pattern: squash the rest of the pixel under
+                    // the cursor, or if the change covers all of it, cut it
+                    // off at the cursor and carry on into the next one. Pixels
+                    // cut off at their start are removed.
+                    std::uint32_t erased = 0;
+                    for (change = -change; change > 0.0;)
+                    {
+                        FinePixel & pixel = pattern.front();
+                        double const rest = pixel.width - offset;
+                        if (change < rest)
+                        {
+                            pixel.width = static_cast<float>(pixel.width - change);
+                            break;
+                        }
+                        change -= rest;
+                        if (offset > 0.0)
+                        {
+                            pixel.width = static_cast<float>(offset);
+                            pattern.next();
+                            offset = 0.0;
+                        }
+                        else
+                        {
+                            pattern.erase(1);
+                            ++erased;
+                        }
+                    }
+                    if (erased > 0)
+                        counters.shorten(erased);
+                }
+                else
+                {
+                    // Lengthen the pattern: insert whole new pixels, starting
+                    // at the cursor (splitting the pixel under it if need be),
+                    // and stretch the first one by any fraction left over
+                    std::uint32_t const disparity = static_cast<std::uint32_t>(change);
+                    if (disparity > 0)
+                    {
+                        if (offset > 0.0)
+                        {
+                            FinePixel & pixel = pattern.front();
+                            FinePixel const rest = {pixel.index, static_cast<float>(pixel.width - offset)};
+                            pixel.width = static_cast<float>(offset);
+                            pattern.next();
+                            pattern.insert(0, &rest, &rest + 1);
+                            offset = 0.0;
+                        }
+                        lengthen(pattern, disparity, x, y, tilew, tileh, rng, run, counters);
+                    }
+                    pattern.front().width += static_cast<float>(change - disparity);
+                }
+            }
+            // Record where between which two tile pixels this pixel lies
+            FinePixel const pixel = pattern.front();
+            indices[x] = pixel.index;
+            following[x] = pattern.peek((pattern.size() > 1) ? 1 : 0).index;
+            weights[x] = static_cast<std::uint8_t>(std::min(255.0, (offset / pixel.width) * 256.0));
+            // Move on by one output pixel
+            for (offset += 1.0; offset >= pattern.front().width;)
+            {
+                offset -= pattern.front().width;
+                pattern.next();
+                // Fold slivers left over from cutting pixels short into the
+                // following pixel, so they don't accumulate
+                while ((pattern.front().width < (1.0f / 16.0f)) && (pattern.size() > 1))
+                {
+                    float const sliver = pattern.front().width;
+                    pattern.erase(1);
+                    pattern.front().width += sliver;
+                }
+            }
+        }
+        stats::add_row(counters);
+    }
+
+    // Mix of two pixels, w / 256 of the way from a to b, one byte at a time
+    inline std::uint32_t blend(std::uint32_t a, std::uint32_t b, std::uint32_t w)
+    {
+        std::uint32_t const v = 256 - w;
+        std::uint32_t const even = ((((a & 0x00ff00ffu) * v) + ((b & 0x00ff00ffu) * w)) >> 8) & 0x00ff00ffu;
+        std::uint32_t const odd = ((((a >> 8) & 0x00ff00ffu) * v) + (((b >> 8) & 0x00ff00ffu) * w)) & 0xff00ff00u;
+        return even | odd;
+    }
+
+    // Size the scratch space for the tile, and make sure it holds a packed
+    // copy of it
+    void prepare(TileView const & tile, Scratch & scratch)
+    {
+        int const tilew = tile.w;
+        int const tileh = tile.h;
+        scratch.run.resize(tilew);
+        scratch.centre.resize(tilew);
+        scratch.saved.resize(tilew);
+        if (scratch.rearrangedtile != &tile)
+        {
+            scratch.rearranged.resize(static_cast<std::size_t>(tilew) * tileh);
+            for (int ty = 0; ty < tileh; ++ty)
+            {
+                std::uint32_t const * row = tile.pixels + (tile.stride * ty);
+                std::copy(row, row + tilew, scratch.rearranged.begin() + (static_cast<std::size_t>(ty) * tilew));
+            }
+            scratch.rearrangedtile = &tile;
+        }
+    }
+
+    // Output pixels are mapped and filled in this many at a time, so that
+    // their tile indices are still in L1 cache when they are looked up
+    std::size_t const chunk = 1024;
+
+    // Start bringing the rows of the packed tile which row y of the output
+    // will read into cache: the current tile row, plus the five above it
+    // which lengthen() takes pixels from
+    void prefetch_rows(Scratch const & scratch, int tilew, int tileh, int y)
+    {
+#if defined(__GNUC__)
+        std::uint32_t const * const rearranged = scratch.rearranged.data();
+        for (int i = 0; i < 6; ++i)
+        {
+            int ty = (y - i) % tileh;
+            if (ty < 0)
+                ty += tileh;
+            std::uint32_t const * row = rearranged + (static_cast<std::size_t>(ty) * tilew);
+            for (int x = 0; x < tilew; x += 16)
+                __builtin_prefetch(row + x);
+        }
+#else
+        static_cast<void>(scratch);
+        static_cast<void>(tilew);
+        static_cast<void>(tileh);
+        static_cast<void>(y);
+#endif
+    }
+
+    // Create a new tile for this row which should line up with the original
+    // image in the centre of the output:
+    //   - Start with the original tile
+    //   - The tile indices in the tile-width region in the centre of the row
+    //     (passed in as centre) tell us which pixel of the tile will end up
+    //     at that point
+    //   - Loop over the current row of the tile, copying each pixel to
+    //     the given index
+    //   - When sampled in the same order... it should reassemble into
+    //     something resembling the original image, in the centre!
+    // Only one row's worth of pixels is changed, so rather than starting from
+    // a fresh copy of the whole tile every time, restore() puts the same
+    // pixels back once the row is done.
+    void rearrange(TileView const & tile, std::uint32_t const * centre, int y, Scratch & scratch)
+    {
+        int const tilew = tile.w;
+        int const tileh = tile.h;
+        std::uint32_t * const rearranged = scratch.rearranged.data();
+        int sy = y;
+        while (sy >= tileh)
+            sy -= tileh;
+        std::uint32_t const * src = tile.pixels + (tile.stride * sy);
+        std::uint32_t * const saved = scratch.saved.data();
+        std::copy(centre, centre + tilew, scratch.centre.begin());
+        for (int x = 0; x < tilew; ++x)
+            saved[x] = rearranged[centre[x]];
+        for (int x = 0; x < tilew; ++x)
+            rearranged[centre[x]] = src[x];
+    }
+
+    // Put back the pixels rearrange() moved
+    void restore(Scratch & scratch)
+    {
+        std::uint32_t * const rearranged = scratch.rearranged.data();
+        std::uint32_t const * const centre = scratch.centre.data();
+        std::uint32_t const * const saved = scratch.saved.data();
+        for (std::size_t x = 0; x < scratch.centre.size(); ++x)
+            rearranged[centre[x]] = saved[x];
+    }
+
+    // Map the rest of a started row and fill it in from the rearranged tile.
+    // Tile indices go straight into the output row, and are replaced by
+    // pixels from the rearranged tile. That can't start until the centre of
+    // the row has been mapped, but from then on the rest of the row is
+    // mapped and filled in a chunk at a time, rather than in two passes over
+    // the whole row.
+    template <bool Exact, bool Cross> void fill_row(TileView const & tile, std::uint8_t const * depth,
+            std::uint32_t * out, int width, int y, double l, RowMapping & mapping, Scratch & scratch)
+    {
+        std::size_t const centre = (width / 2) - (tile.w / 2);
+        std::uint32_t const * const rearranged = scratch.rearranged.data();
+        std::size_t done = 0;
+        while (done < static_cast<std::size_t>(width))
+        {
+            std::size_t const end = (done == 0) ? (centre + tile.w) : std::min<std::size_t>(width, done + chunk);
+            {
+                stats::Timer timer(stats::Stage::Map);
+                map_row<Exact, Cross>(mapping, depth, out, end, y, tile.w, tile.h, l, scratch);
+            }
+            stats::Timer timer(stats::Stage::Rearrange);
+            if (done == 0)
+                rearrange(tile, out + centre, y, scratch);
+            for (std::size_t x = done; x < end; ++x)
+                out[x] = rearranged[out[x]];
+            done = end;
+        }
+    }
+}
+
+void render_flat_row(TileView const & tile, std::uint32_t * out, int width, int y)
+{
+    stats::Timer timer(stats::Stage::Rearrange);
+    int const tilew = tile.w;
+    int sy = y;
+    while (sy >= tile.h)
+        sy -= tile.h;
+    std::uint32_t const * src = tile.pixels + (tile.stride * sy);
+    // With nothing to change the pattern, output pixel x comes from tile
+    // pixel x, except that the centre of the row is rearranged to show the
+    // tile row as it is: so the row is the tile row, rotated to line up
+    // with the centre. Lay down one copy of it, then keep doubling.
+    int const centre = (width / 2) - (tilew / 2);
+    int const shift = centre % tilew;
+    std::copy(src + (tilew - shift), src + tilew, out);
+    std::copy(src, src + (tilew - shift), out + shift);
+    for (int x = tilew; x < width;)
+    {
+        int const n = std::min(x, width - x);
+        std::copy(out, out + n, out + x);
+        x += n;
+    }
+    stats::Counters counters;
+    counters.length(tilew);
+    stats::add_row(counters);
+}
+
+void render_row(TileView const & tile, std::uint8_t const * depth, std::uint32_t * out,
+        int width, int y, bool cross, double l, Scratch & scratch)
+{
+    if ((depth[0] == 0) && (find_change(depth, 1, width) == static_cast<std::size_t>(width)))
+    {
+        render_flat_row(tile, out, width, y);
+        return;
+    }
+    prepare(tile, scratch);
+    RowMapping mapping(y);
+    {
+        stats::Timer timer(stats::Stage::Map);
+        update_lengths(scratch.lengths, tile.w, l, cross);
+        prefetch_rows(scratch, tile.w, tile.h, y);
+        start_row(mapping, out, y, tile.w, tile.h, l, scratch);
+    }
+    // Choose the kernel once for the whole row
+    if (scratch.lengths.exact)
+    {
+        if (cross)
+            fill_row<true, true>(tile, depth, out, width, y, l, mapping, scratch);
+        else
+            fill_row<true, false>(tile, depth, out, width, y, l, mapping, scratch);
+    }
+    else if (cross)
+        fill_row<false, true>(tile, depth, out, width, y, l, mapping, scratch);
+    else
+        fill_row<false, false>(tile, depth, out, width, y, l, mapping, scratch);
+    restore(scratch);
+    stats::add_row(mapping.counters);
+}
+
+void render_row(TileView const & tile, float const * depth, std::uint32_t * out,
+        int width, int y, bool cross, double l, Scratch & scratch)
+{
+    if (std::all_of(depth, depth + width, [](float d) { return d == 0.0f; }))
+    {
+        render_flat_row(tile, out, width, y);
+        return;
+    }
+    prepare(tile, scratch);
+    scratch.indices.resize(width);
+    scratch.following.resize(width);
+    scratch.weights.resize(width);
+    scratch.finerun.resize(tile.w);
+    {
+        stats::Timer timer(stats::Stage::Map);
+        if (cross)
+            map_row_fine<true>(depth, width, y, tile.w, tile.h, l, scratch);
+        else
+            map_row_fine<false>(depth, width, y, tile.w, tile.h, l, scratch);
+    }
+    stats::Timer timer(stats::Stage::Rearrange);
+    rearrange(tile, scratch.indices.data() + ((width / 2) - (tile.w / 2)), y, scratch);
+    // Fill in the row by blending pairs of pixels from the rearranged tile
+    std::uint32_t const * rearranged = scratch.rearranged.data();
+    std::uint32_t const * indices = scratch.indices.data();
+    std::uint32_t const * following = scratch.following.data();
+    std::uint8_t const * weights = scratch.weights.data();
+    for (int x = 0; x < width; ++x)
+        out[x] = blend(rearranged[indices[x]], rearranged[following[x]], weights[x]);
+    restore(scratch);
+}
@@ -0,0 +1,181 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_RENDER_HXX
+#define TEXT_TO_STEREOGRAM_RENDER_HXX
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "pattern.hxx"
+
+// The stereogram rendering engine. Works purely on buffers in memory; loading
+// and saving images is left to the caller.
+
+// Deterministic stream of pseudo-random numbers for a single row (SplitMix64),
+// used to pick the tile rows pixels are inserted from. Seeding from both a
+// fixed seed and the row number means each row always sees the same sequence,
+// regardless of which thread renders it, or in which order rows are rendered.
+class RowRandom
+{
+    public:
+        explicit RowRandom(int row)
+            : state(seed ^ (0x9e3779b97f4a7c15u * (static_cast<std::uint64_t>(row) + 1)))
+        {
+        }
+
+        std::uint32_t next()
+        {
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15u);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+            return static_cast<std::uint32_t>((z ^ (z >> 31)) >> 32);
+        }
+
+        // Uniformly distributed integer in [0, n)
+        int below(int n)
+        {
+            return static_cast<int>((static_cast<std::uint64_t>(next()) * n) >> 32);
+        }
+
+    private:
+        static constexpr std::uint64_t seed = 42;
+        std::uint64_t state;
+};
+
+// Tile image, as 32-bit pixels in whatever format the output should be in.
+// The pixels belong to the caller; row y starts at pixels + (y * stride).
+struct TileView
+{
+    int w = 0;
+    int h = 0;
+    std::uint32_t const * pixels = nullptr;
+    std::ptrdiff_t stride = 0;
+};
+
+// Pattern length for every depth value, for a given tile width, pattern
+// length divisor and viewing mode. Only usable when exact is set; see
+// map_row() in render.cxx.
+struct LengthTable
+{
+    int tilew = 0;
+    double l = 0.0;
+    bool cross = false;
+    bool exact = false;
+    std::uint32_t lengths[256];
+};
+
+// A pixel of the pattern when depth values are fractional: a tile pixel, and
+// how much of the output it covers, which needn't be a whole pixel. Within
+// it, output pixels are blended with the next tile pixel in the pattern.
+struct FinePixel
+{
+    std::uint32_t index;
+    float width;
+};
+
+// Per-thread scratch space, allocated on first use and reused for every row.
+// A Scratch keeps some state between rows which depends on the tile, so use
+// separate ones for rendering with different tiles.
+struct Scratch
+{
+    // Repeating pattern of tile indices
+    Pattern pattern;
+    BasicPattern<FinePixel> finepattern;
+    // Depth value of each pixel in the current output row. Not used by
+    // render_row() itself; somewhere for callers to put them.
+    std::vector<std::uint8_t> depth;
+    // Likewise for fractional depth values
+    std::vector<float> finedepth;
+    // Likewise for a row of 32-bit output pixels, when the output itself
+    // is in some other format
+    std::vector<std::uint32_t> pixels;
+    // Tile index of each pixel in the current output row, with fractional
+    // depth values. Otherwise they are worked out in the output row itself.
+    std::vector<std::uint32_t> indices;
+    // With fractional depth values, each pixel lies weights[x] / 256 of the
+    // way from tile pixel indices[x] to tile pixel following[x]
+    std::vector<std::uint32_t> following;
+    std::vector<std::uint8_t> weights;
+    // Run of consecutive tile indices for lengthening the pattern
+    std::vector<std::uint32_t> run;
+    std::vector<FinePixel> finerun;
+    // Tile rearranged for the current output row, tightly packed so that
+    // tile indices (y * w + x) address pixels directly. In between rows this
+    // holds an unmodified copy of the tile. Reset rearrangedtile if the tile's
+    // pixels may have changed since the last row was rendered.
+    std::vector<std::uint32_t> rearranged;
+    TileView const * rearrangedtile = nullptr;
+    // Tile indices of the tile-width region in the centre of the current
+    // row, and the pixels of the unmodified tile overwritten at them while
+    // rearranging it
+    std::vector<std::uint32_t> centre;
+    std::vector<std::uint32_t> saved;
+    LengthTable lengths;
+};
+
+// Render a single row of a stereogram, width pixels wide, into out.
+// depth holds one depth value per output pixel (0 = far, 255 = near), with
+// the depth map already positioned where it should appear in the output.
+// width must be at least the tile width. Only touches out and the scratch
+// space, so rows may be rendered concurrently as long as each thread has its
+// own scratch space.
+void render_row(TileView const & tile, std::uint8_t const * depth, std::uint32_t * out,
+        int width, int y, bool cross, double l, Scratch & scratch);
+
+// As above, but with depth values anywhere from 0.0 (far) to 255.0 (near),
+// e.g. from a 16-bit or floating point depth map. Pattern lengths aren't
+// rounded to whole pixels: instead the pattern is stretched or squashed to
+// its exact length, blending neighbouring tile pixels, so that smooth
+// surfaces come out smooth instead of in steps.
+void render_row(TileView const & tile, float const * depth, std::uint32_t * out,
+        int width, int y, bool cross, double l, Scratch & scratch);
+
+// Render a row whose depth values are all 0, which is just the tile row
+// repeated across the output. render_row() does this by itself for such
+// rows; call it directly to skip building a row of depth values first.
+void render_flat_row(TileView const & tile, std::uint32_t * out, int width, int y);
+
+// Call fn(row, worker) once for every row in [0, rows), with bands of band
+// consecutive rows handed out to the given number of worker threads as they
+// become free. Each worker renders its band from top to bottom; consecutive
+// rows read mostly the same rows of the tile, so bigger bands keep each
+// worker's share of the tile and output in cache, at the cost of less even
+// sharing out of the work at the end.
+template <typename F> void parallel_rows(int rows, unsigned jobs, F && fn, int band = 1)
+{
+    std::atomic<int> next(0);
+    auto work = [&](unsigned worker)
+    {
+        for (int first = next.fetch_add(band); first < rows; first = next.fetch_add(band))
+        {
+            int const last = std::min(rows, first + band);
+            for (int row = first; row < last; ++row)
+                fn(row, worker);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned worker = 1; worker < jobs; ++worker)
+        threads.emplace_back(work, worker);
+    work(0);
+    for (auto & t : threads)
+        t.join();
+}
+
+#endif
@@ -0,0 +1,742 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <SDL.h>
+#include <SDL_image.h>
+#include <SDL_ttf.h>
+
+#include "formats.hxx"
+#include "images.hxx"
+#include "server.hxx"
+#include "stream.hxx"
+#include "stats.hxx"
+
+namespace
+{
+    using Request = std::map<std::string, std::string>;
+
+    // Parse a single-line JSON object whose values are all strings, numbers,
+    // booleans or null. Values are stored as strings, without quotes.
+    bool parse_request(std::string const & line, Request & request)
+    {
+        std::size_t i = 0;
+        auto skip = [&]
+        {
+            while ((i < line.size()) && std::isspace(static_cast<unsigned char>(line[i])))
+                ++i;
+        };
+        auto string = [&](std::string & out)
+        {
+            if (line[i] != '"')
+                return false;
+            for (++i; (i < line.size()) && (line[i] != '"'); ++i)
+            {
+                if (line[i] != '\\')
+                {
+                    out += line[i];
+                    continue;
+                }
+                if (++i >= line.size())
+                    return false;
+                switch (line[i])
+                {
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u':
+                    {
+                        // Basic multilingual plane only; encode as UTF-8
+                        if ((i + 4) >= line.size())
+                            return false;
+                        char * end;
+                        std::string hex = line.substr(i + 1, 4);
+                        unsigned long c = std::strtoul(hex.c_str(), &end, 16);
+                        if (end != (hex.c_str() + 4))
+                            return false;
+                        i += 4;
+                        if (c < 0x80)
+                            out += static_cast<char>(c);
+                        else if (c < 0x800)
+                        {
+                            out += static_cast<char>(0xc0 | (c >> 6));
+                            out += static_cast<char>(0x80 | (c & 0x3f));
+                        }
+                        else
+                        {
+                            out += static_cast<char>(0xe0 | (c >> 12));
+                            out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+                            out += static_cast<char>(0x80 | (c & 0x3f));
+                        }
+                        break;
+                    }
+                    default:
+                        out += line[i];
+                }
+            }
+            if (i >= line.size())
+                return false;
+            ++i;
+            return true;
+        };
+
+        skip();
+        if (line[i] != '{')
+            return false;
+        ++i;
+        skip();
+        if (line[i] == '}')
+            ++i;
+        else
+        {
+            for (;;)
+            {
+                std::string key, value;
+                skip();
+                if (!string(key))
+                    return false;
+                skip();
+                if (line[i] != ':')
+                    return false;
+                ++i;
+                skip();
+                if (line[i] == '"')
+                {
+                    if (!string(value))
+                        return false;
+                }
+                else
+                {
+                    while ((i < line.size()) && (line[i] != ',') && (line[i] != '}')
+                            && !std::isspace(static_cast<unsigned char>(line[i])))
+                        value += line[i++];
+                    if (value.empty())
+                        return false;
+                }
+                request[key] = value;
+                skip();
+                if (line[i] == ',')
+                {
+                    ++i;
+                    continue;
+                }
+                if (line[i] != '}')
+                    return false;
+                ++i;
+                break;
+            }
+        }
+        skip();
+        return i == line.size();
+    }
+
+    // Quote a string for inclusion in a JSON response
+    std::string quote(std::string const & s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            if ((c == '"') || (c == '\\'))
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+        return out + '"';
+    }
+
+    // Look up an optional numeric field. Returns false if it is present but
+    // not a valid number.
+    template <typename T> bool number(Request const & request, char const * key, T & value)
+    {
+        auto i = request.find(key);
+        if (i == request.end())
+            return true;
+        std::istringstream in(i->second);
+        in >> value;
+        return !in.fail() && in.eof();
+    }
+
+    // Least-recently-used cache of shared resources. Loading is done with
+    // the cache unlocked, so a slow load only holds up requests for the same
+    // key, which wait for it rather than loading it again.
+    template <typename Key, typename Value> class Cache
+    {
+        public:
+            explicit Cache(std::size_t capacity)
+                : capacity(capacity)
+            {
+            }
+
+            // Return the cached value for key, or cache & return the result
+            // of load() if there is none. Returns null if load() fails, with
+            // the reason from SDL_GetError() on whichever thread loaded it.
+            template <typename Load> std::shared_ptr<Value> get(Key const & key, Load && load)
+            {
+                std::shared_ptr<Entry> entry;
+                std::promise<Loaded> promise;
+                bool loading = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (auto i = entries.begin(); i != entries.end(); ++i)
+                    {
+                        if (i->first == key)
+                        {
+                            entries.splice(entries.begin(), entries, i);
+                            entry = i->second;
+                            break;
+                        }
+                    }
+                    if (!entry)
+                    {
+                        entry = std::make_shared<Entry>(promise.get_future().share());
+                        entries.emplace_front(key, entry);
+                        if (entries.size() > capacity)
+                            entries.pop_back();
+                        loading = true;
+                    }
+                }
+                if (!loading)
+                {
+                    Loaded const & loaded = entry->get();
+                    if (!loaded.value)
+                        SDL_SetError("%s", loaded.error.c_str());
+                    return loaded.value;
+                }
+
+                Loaded loaded;
+                try
+                {
+                    loaded.value = load();
+                }
+                catch (...)
+                {
+                    forget(entry);
+                    promise.set_exception(std::current_exception());
+                    throw;
+                }
+                if (!loaded.value)
+                {
+                    loaded.error = SDL_GetError();
+                    forget(entry);
+                }
+                promise.set_value(loaded);
+                return loaded.value;
+            }
+
+        private:
+            struct Loaded
+            {
+                std::shared_ptr<Value> value;
+                std::string error;
+            };
+            using Entry = std::shared_future<Loaded>;
+
+            // Drop a failed entry, so that the next request tries again
+            void forget(std::shared_ptr<Entry> const & entry)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                entries.remove_if([&](std::pair<Key, std::shared_ptr<Entry>> const & i) { return i.second == entry; });
+            }
+
+            std::size_t const capacity;
+            std::mutex mutex;
+            // Most recently used first
+            std::list<std::pair<Key, std::shared_ptr<Entry>>> entries;
+    };
+
+    // SDL_ttf is not thread safe, so all use of it goes through this
+    std::mutex ttf;
+
+    struct Server
+    {
+        Cache<std::string, Tile const> tiles{16};
+        Cache<std::pair<std::string, int>, TTF_Font> fonts{16};
+
+        // Render a single request, using the given context and depth plane.
+        // Returns an empty string on success, or a description of what went
+        // wrong.
+        std::string render(Request const & request, stereogram::Context & context, DepthPlane & depthplane)
+        {
+            // Same defaults as the command line
+            int w = 640;
+            int h = 480;
+            int s = 24;
+            int d = 60;
+            double l = 2.0;
+            int cross = 0;
+            if (!number(request, "width", w) || !number(request, "height", h)
+                    || !number(request, "size", s) || !number(request, "depth", d)
+                    || !number(request, "divisor", l))
+                return "Invalid number";
+            auto field = [&](char const * key) -> char const *
+            {
+                auto i = request.find(key);
+                return (i == request.end()) ? nullptr : i->second.c_str();
+            };
+            if (char const * c = field("cross"))
+                cross = ((std::strcmp(c, "true") == 0) || (std::strcmp(c, "1") == 0));
+            char const * tilename = field("tile");
+            char const * depthname = field("map");
+            char const * fontname = field("font");
+            char const * text = field("text");
+            char const * outfname = field("output");
+            if ((tilename == nullptr) || (outfname == nullptr) || (w <= 0) || (h <= 0) || (s <= 0))
+                return "Missing tile or output, or invalid size";
+            if ((depthname == nullptr) == (fontname == nullptr))
+                return "Please specify just a string & font pair, or a depth map, not both";
+            if ((fontname != nullptr) && ((d <= 0) || (d > 255)))
+                return "Depth value must be between 0 and 256";
+            if (l <= 1.0)
+                return "Pattern length divisor must be greater than 1.0";
+
+            auto tile = tiles.get(tilename, [&]
+            {
+                stats::Timer timer(stats::Stage::LoadTile);
+                auto tile = std::make_shared<Tile>();
+                if (!load_tile(tilename, *tile))
+                    tile.reset();
+                return tile;
+            });
+            if (!tile)
+                return std::string("Unable to load tile image: ") + SDL_GetError();
+            if ((w < tile->w) || (h < tile->h))
+                return "Image must be at least as big as the tile in both dimensions";
+
+            SDL_Surface * depthsurface = nullptr;
+            DepthReader depthreader;
+            bool const mapped = (depthname != nullptr) && MappedImage::recognised(depthname);
+            if (mapped)
+            {
+                stats::Timer timer(stats::Stage::LoadDepth);
+                if (!depthreader.open(depthname))
+                    return std::string("Unable to load depth map image: ") + SDL_GetError();
+            }
+            else if (depthname != nullptr)
+            {
+                stats::Timer timer(stats::Stage::LoadDepth);
+                if (!(depthsurface = IMG_Load(depthname)))
+                    return std::string("Unable to load depth map image: ") + IMG_GetError();
+            }
+            else
+            {
+                auto font = fonts.get(std::make_pair(std::string(fontname), s), [&]
+                {
+                    std::lock_guard<std::mutex> lock(ttf);
+                    // Only a font that opened gets the deleter, which takes
+                    // the lock held here
+                    TTF_Font * opened = TTF_OpenFont(fontname, s);
+                    if (!opened)
+                        return std::shared_ptr<TTF_Font>();
+                    return std::shared_ptr<TTF_Font>(opened, [](TTF_Font * font)
+                    {
+                        std::lock_guard<std::mutex> lock(ttf);
+                        TTF_CloseFont(font);
+                    });
+                });
+                if (!font)
+                    return std::string("Unable to open font: ") + TTF_GetError();
+                std::lock_guard<std::mutex> lock(ttf);
+                stats::Timer timer(stats::Stage::RenderText);
+                if (!(depthsurface = render_text(font.get(), (text != nullptr) ? text : "Hello, world!", d)))
+                    return std::string("Unable to render text surface: ") + TTF_GetError();
+            }
+
+            // The canvas checks the size is sensible before the depth plane
+            // is sized to match
+            SDL_Surface * canvas = create_canvas(w, h);
+            if (!canvas)
+            {
+                SDL_FreeSurface(depthsurface);
+                return std::string("Unable to create window-sized surface: ") + SDL_GetError();
+            }
+            bool placed;
+            {
+                stats::Timer timer(stats::Stage::PlaceDepth);
+                placed = mapped ? place_depth(depthplane, depthreader, w, h, tile->w)
+                    : place_depth(depthplane, depthsurface, w, h, tile->w);
+            }
+            SDL_FreeSurface(depthsurface);
+            if (!placed)
+            {
+                SDL_FreeSurface(canvas);
+                return std::string("Unable to place depth map: ") + SDL_GetError();
+            }
+            std::string error;
+            {
+                stats::Timer timer(stats::Stage::Render);
+                if (!context.render(depthplane.image(), tile->image(), canvas_image(canvas), canvas_options(cross != 0, l)))
+                    error = "Unable to render: " + context.error();
+            }
+            stats::Timer timer(stats::Stage::Save);
+            std::vector<std::uint8_t> outbuffer;
+            if (error.empty() && !save_canvas(canvas, outfname, outbuffer))
+                error = std::string("Unable to save image: ") + SDL_GetError();
+            SDL_FreeSurface(canvas);
+            return error;
+        }
+    };
+
+    // Initialise everything rendering needs, without a display
+    bool init()
+    {
+        if (SDL_Init(0) != 0)
+        {
+            std::cerr << "Unable to initialise SDL: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        std::atexit(SDL_Quit);
+        if (IMG_Init(0) != 0)
+        {
+            std::cerr << "Unable to initialise SDL_image: " << IMG_GetError() << std::endl;
+            return false;
+        }
+        std::atexit(IMG_Quit);
+        if (TTF_Init() != 0)
+        {
+            std::cerr << "Unable to initialise SDL_ttf: " << TTF_GetError() << std::endl;
+            return false;
+        }
+        std::atexit(TTF_Quit);
+        return true;
+    }
+
+    // Split a manifest line into words as a shell would: separated by
+    // whitespace, with single or double quotes around words containing it,
+    // and backslash escaping the next character outside single quotes.
+    // Returns false if a quote is left open.
+    bool split_words(std::string const & line, std::vector<std::string> & words)
+    {
+        std::size_t i = 0;
+        for (;;)
+        {
+            while ((i < line.size()) && std::isspace(static_cast<unsigned char>(line[i])))
+                ++i;
+            if ((i == line.size()) || (line[i] == '#'))
+                return true;
+            std::string word;
+            char quote = '\0';
+            for (; i < line.size(); ++i)
+            {
+                char const c = line[i];
+                if (quote == '\'')
+                {
+                    if (c == '\'')
+                        quote = '\0';
+                    else
+                        word += c;
+                }
+                else if ((c == '\\') && ((i + 1) < line.size()))
+                    word += line[++i];
+                else if (quote == '"')
+                {
+                    if (c == '"')
+                        quote = '\0';
+                    else
+                        word += c;
+                }
+                else if ((c == '\'') || (c == '"'))
+                    quote = c;
+                else if (std::isspace(static_cast<unsigned char>(c)))
+                    break;
+                else
+                    word += c;
+            }
+            if (quote != '\0')
+                return false;
+            words.push_back(std::move(word));
+        }
+    }
+
+    // Convert a manifest line's options, the same as the command line's,
+    // into the equivalent server request. Returns a description of what is
+    // wrong with them, or an empty string.
+    std::string parse_job(std::vector<std::string> const & words, Request & request)
+    {
+        static std::pair<char, char const *> const keys[] = {
+            {'t', "tile"}, {'m', "map"}, {'f', "font"}, {'s', "size"}, {'d', "depth"},
+            {'w', "width"}, {'h', "height"}, {'l', "divisor"}, {'o', "output"}
+        };
+        std::string text;
+        bool options = true;
+        for (std::size_t i = 0; i < words.size(); ++i)
+        {
+            std::string const & word = words[i];
+            if (!options || (word.size() < 2) || (word[0] != '-'))
+            {
+                // Anything that isn't an option is the text to render
+                if (!text.empty())
+                    text += ' ';
+                text += word;
+                continue;
+            }
+            if (word == "--")
+            {
+                options = false;
+                continue;
+            }
+            if (word == "-c")
+            {
+                request["cross"] = "true";
+                continue;
+            }
+            char const * key = nullptr;
+            for (auto const & k : keys)
+            {
+                if (word[1] == k.first)
+                    key = k.second;
+            }
+            if (key == nullptr)
+                return "Unrecognised option " + word;
+            if (word.size() > 2)
+                request[key] = word.substr(2);
+            else if (++i < words.size())
+                request[key] = words[i];
+            else
+                return "Missing value for option " + word;
+        }
+        if (text.empty())
+            return std::string();
+        if (request.count("map") != 0)
+            return "Please specify just a string & font pair, or a depth map, not both";
+        request["text"] = text;
+        return std::string();
+    }
+}
+
+int serve(unsigned jobs)
+{
+    if (!init())
+        return 1;
+
+    Server server;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::string> queue;
+    bool done = false;
+    std::mutex output;
+
+    auto work = [&]
+    {
+        // Each worker renders one request at a time, on its own thread
+        stereogram::Context context(1);
+        DepthPlane depthplane;
+        for (;;)
+        {
+            std::string line;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return done || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                line = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            Request request;
+            std::string error;
+            try
+            {
+                if (!parse_request(line, request))
+                    error = "Unable to parse request";
+                else
+                    error = server.render(request, context, depthplane);
+            }
+            catch (std::exception const & e)
+            {
+                // One bad request shouldn't take the server down with it
+                error = std::string("Unable to handle request: ") + e.what();
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::string response = "{\"id\": " + quote(request["id"]);
+            if (error.empty())
+                response += ", \"status\": \"ok\", \"ms\": " + std::to_string(elapsed.count()) + "}";
+            else
+                response += ", \"status\": \"error\", \"error\": " + quote(error) + "}";
+            std::lock_guard<std::mutex> lock(output);
+            std::cout << response << std::endl;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; ++i)
+        workers.emplace_back(work);
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(line));
+        ready.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        ready.notify_all();
+    }
+    for (auto & t : workers)
+        t.join();
+    return 0;
+}
+
+int run_manifest(char const * filename, unsigned jobs)
+{
+    struct Job
+    {
+        int line;
+        Request request;
+        long pixels;
+    };
+    std::vector<Job> manifest;
+    {
+        std::ifstream file;
+        std::istream * in = &std::cin;
+        if (std::strcmp(filename, "-") != 0)
+        {
+            file.open(filename);
+            if (!file)
+            {
+                std::cerr << "Unable to open manifest " << filename << std::endl;
+                return 1;
+            }
+            in = &file;
+        }
+        std::string line;
+        for (int lineno = 1; std::getline(*in, line); ++lineno)
+        {
+            std::vector<std::string> words;
+            if (!split_words(line, words))
+            {
+                std::cerr << filename << ":" << lineno << ": Unterminated quote" << std::endl;
+                return 1;
+            }
+            if (words.empty())
+                continue;
+            Job job{lineno, Request(), 0};
+            std::string const error = parse_job(words, job.request);
+            if (!error.empty())
+            {
+                std::cerr << filename << ":" << lineno << ": " << error << std::endl;
+                return 1;
+            }
+            int w = 640;
+            int h = 480;
+            if (!number(job.request, "width", w) || !number(job.request, "height", h))
+            {
+                std::cerr << filename << ":" << lineno << ": Invalid number" << std::endl;
+                return 1;
+            }
+            job.pixels = static_cast<long>(w) * h;
+            manifest.push_back(std::move(job));
+        }
+    }
+    if (!init())
+        return 1;
+
+    // Largest first, so the last jobs to be picked up are the quickest and
+    // all workers finish at about the same time
+    std::stable_sort(manifest.begin(), manifest.end(), [](Job const & a, Job const & b)
+    {
+        return a.pixels > b.pixels;
+    });
+
+    // Images this big are rendered one at a time, their rows shared between
+    // all the threads; smaller ones are rendered concurrently, one per
+    // thread, which also overlaps their loading & saving.
+    long const large = 4L << 20;
+
+    Server server;
+    std::mutex output;
+    bool failed = false;
+    auto run = [&](Job const & job, stereogram::Context & context, DepthPlane & depthplane)
+    {
+        std::string error;
+        try
+        {
+            error = server.render(job.request, context, depthplane);
+        }
+        catch (std::exception const & e)
+        {
+            error = std::string("Unable to handle request: ") + e.what();
+        }
+        if (error.empty())
+            return;
+        std::lock_guard<std::mutex> lock(output);
+        std::cerr << filename << ":" << job.line << ": " << error << std::endl;
+        failed = true;
+    };
+
+    std::size_t first = 0;
+    if ((jobs > 1) && !manifest.empty() && (manifest.front().pixels >= large))
+    {
+        stereogram::Context context(jobs);
+        DepthPlane depthplane;
+        for (; (first < manifest.size()) && (manifest[first].pixels >= large); ++first)
+            run(manifest[first], context, depthplane);
+    }
+
+    // Each worker takes the next job as soon as it has finished its last
+    std::atomic<std::size_t> next(first);
+    auto work = [&]
+    {
+        stereogram::Context context(1);
+        DepthPlane depthplane;
+        for (std::size_t i; (i = next.fetch_add(1)) < manifest.size();)
+            run(manifest[i], context, depthplane);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < std::min<std::size_t>(jobs, manifest.size() - first); ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto & t : workers)
+        t.join();
+    return failed ? 1 : 0;
+}
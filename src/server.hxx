@@ -0,0 +1,47 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_SERVER_HXX
+#define TEXT_TO_STEREOGRAM_SERVER_HXX
+
+// Run as a long-lived render server. Requests are read from standard input,
+// one JSON object per line, e.g.:
+//   {"id": "1", "tile": "gold_tile.png", "font": "Montserrat.otf", "size": 140,
+//    "depth": 60, "text": "Hello", "width": 1280, "height": 720,
+//    "cross": false, "divisor": 2.0, "output": "hello.png"}
+// with "map": "depth.png" in place of font, size, depth & text to render a
+// depth map. Missing fields take the same defaults as on the command line.
+// One JSON response per request is written to standard output, in order of
+// completion, e.g.:
+//   {"id": "1", "status": "ok", "ms": 12.5}
+//   {"id": "2", "status": "error", "error": "Unable to open font: ..."}
+// Up to jobs requests are rendered at a time. Decoded tiles and opened fonts
+// are cached between requests. Returns the process exit status once standard
+// input is closed and all requests have been answered.
+int serve(unsigned jobs);
+
+// Render every job in a manifest file (- for standard input), one per line,
+// each given by the same options as the command line, e.g.:
+//   -t gold_tile.png -f Montserrat.otf -s 140 -w 1280 -h 720 -o hello.png Hello
+//   -t gold_tile.png -m depth.png -c -l 4.0 -o shape.png
+// Words are separated by whitespace, and may be quoted; lines starting with
+// # are ignored. Tiles and fonts are loaded once however many jobs use them.
+// Large images are rendered one at a time using jobs threads; the rest are
+// rendered up to jobs at a time. Errors are reported on standard error with
+// their line number. Returns the process exit status: non-zero if the
+// manifest is invalid or any job failed.
+int run_manifest(char const * filename, unsigned jobs);
+
+#endif
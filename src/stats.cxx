@@ -0,0 +1,118 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <mutex>
+
+#include "stats.hxx"
+
+#ifdef TEXT_TO_STEREOGRAM_STATS
+
+namespace
+{
+    struct Totals
+    {
+        double ms[static_cast<int>(stats::Stage::Count)] = {};
+        std::uint64_t rows = 0;
+        stats::Counters counters;
+
+        void add(Totals const & other)
+        {
+            for (int i = 0; i < static_cast<int>(stats::Stage::Count); ++i)
+                ms[i] += other.ms[i];
+            rows += other.rows;
+            counters.shortened += other.counters.shortened;
+            counters.lengthened += other.counters.lengthened;
+            counters.erased += other.counters.erased;
+            counters.inserted += other.counters.inserted;
+            counters.wraparound += other.counters.wraparound;
+            counters.length(other.counters.maxlength);
+        }
+    };
+
+    // Totals of threads which have exited
+    struct Shared
+    {
+        std::mutex mutex;
+        Totals totals;
+    };
+
+    Shared & shared()
+    {
+        static Shared s;
+        return s;
+    }
+
+    struct Local
+    {
+        Totals totals;
+
+        Local()
+        {
+            // Make sure the shared totals outlive this
+            shared();
+        }
+
+        ~Local()
+        {
+            Shared & s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.totals.add(totals);
+        }
+    };
+
+    thread_local Local local;
+
+    char const * const stagenames[] = {
+        "load_tile", "load_depth", "render_text", "place_depth", "render", "map", "rearrange", "save"
+    };
+}
+
+void stats::add_row(Counters const & counters)
+{
+    Totals row;
+    row.rows = 1;
+    row.counters = counters;
+    local.totals.add(row);
+}
+
+void stats::add_time(Stage stage, double ms)
+{
+    local.totals.ms[static_cast<int>(stage)] += ms;
+}
+
+void stats::write_json(std::ostream & out)
+{
+    Totals totals;
+    {
+        Shared & s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        totals = s.totals;
+    }
+    totals.add(local.totals);
+    out << "{\"stages_ms\": {";
+    for (int i = 0; i < static_cast<int>(Stage::Count); ++i)
+        out << (i ? ", " : "") << '"' << stagenames[i] << "\": " << totals.ms[i];
+    out << "}, \"counters\": {"
+        << "\"rows\": " << totals.rows
+        << ", \"shorten_events\": " << totals.counters.shortened
+        << ", \"lengthen_events\": " << totals.counters.lengthened
+        << ", \"pixels_erased\": " << totals.counters.erased
+        << ", \"pixels_inserted\": " << totals.counters.inserted
+        << ", \"wraparound_inserts\": " << totals.counters.wraparound
+        << ", \"max_pattern_length\": " << totals.counters.maxlength
+        << "}}" << std::endl;
+}
+
+#endif
@@ -0,0 +1,148 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_STATS_HXX
+#define TEXT_TO_STEREOGRAM_STATS_HXX
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Optional statistics: time spent in each stage of rendering, and counts of
+// the work done inside the renderer. Only compiled in when
+// TEXT_TO_STEREOGRAM_STATS is defined; otherwise everything here does nothing
+// and costs nothing.
+//
+// Statistics are gathered per thread and merged into the totals when each
+// thread exits, so there is no contention while rendering.
+namespace stats
+{
+    enum class Stage
+    {
+        LoadTile,
+        LoadDepth,
+        RenderText,
+        PlaceDepth,
+        Render,
+        // Parts of Render, timed on the worker threads and summed over them:
+        // working out which tile pixel goes where, then rearranging the tile
+        // and filling in the row from it
+        Map,
+        Rearrange,
+        Save,
+        Count
+    };
+
+#ifdef TEXT_TO_STEREOGRAM_STATS
+    bool const enabled = true;
+
+    // Changes to the repeating pattern while rendering a row
+    struct Counters
+    {
+        std::uint64_t shortened = 0;
+        std::uint64_t lengthened = 0;
+        std::uint64_t erased = 0;
+        std::uint64_t inserted = 0;
+        std::uint64_t wraparound = 0;
+        std::size_t maxlength = 0;
+
+        void shorten(std::uint32_t n)
+        {
+            ++shortened;
+            erased += n;
+        }
+
+        // wrapped: whether the inserted pixels wrapped around the tile edge
+        void lengthen(std::uint32_t n, bool wrapped)
+        {
+            ++lengthened;
+            inserted += n;
+            wraparound += wrapped;
+        }
+
+        void length(std::size_t n)
+        {
+            if (n > maxlength)
+                maxlength = n;
+        }
+    };
+
+    // Add a rendered row's counters to the current thread's statistics
+    void add_row(Counters const & counters);
+
+    // Add time spent on a stage to the current thread's statistics
+    void add_time(Stage stage, double ms);
+
+    // Times the enclosing scope as the given stage
+    class Timer
+    {
+        public:
+            explicit Timer(Stage stage)
+                : stage(stage), start(std::chrono::steady_clock::now())
+            {
+            }
+
+            ~Timer()
+            {
+                add_time(stage, std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start).count());
+            }
+
+        private:
+            Stage const stage;
+            std::chrono::steady_clock::time_point const start;
+    };
+
+    // Write the statistics of all threads which have exited, plus the calling
+    // thread, as a JSON object
+    void write_json(std::ostream & out);
+#else
+    bool const enabled = false;
+
+    struct Counters
+    {
+        void shorten(std::uint32_t)
+        {
+        }
+
+        void lengthen(std::uint32_t, bool)
+        {
+        }
+
+        void length(std::size_t)
+        {
+        }
+    };
+
+    inline void add_row(Counters const &)
+    {
+    }
+
+    class Timer
+    {
+        public:
+            explicit Timer(Stage)
+            {
+            }
+    };
+
+    inline void write_json(std::ostream &)
+    {
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,292 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "depth.hxx"
+#include "render.hxx"
+#include "stereogram.hxx"
+
+namespace
+{
+    // Byte offsets of alpha, red, green & blue within a 32-bit pixel
+    struct Layout
+    {
+        int a;
+        int r;
+        int g;
+        int b;
+    };
+
+    Layout layout(stereogram::PixelFormat format)
+    {
+        switch (format)
+        {
+            case stereogram::PixelFormat::BGRA32:
+                return {3, 2, 1, 0};
+            case stereogram::PixelFormat::RGBA32:
+                return {3, 0, 1, 2};
+            case stereogram::PixelFormat::ABGR32:
+                return {0, 3, 2, 1};
+            default:
+                return {0, 1, 2, 3};
+        }
+    }
+
+    // Shift which moves the byte at the given offset within a 32-bit pixel
+    // to the bottom of a std::uint32_t holding that pixel
+    unsigned byte_shift(int offset)
+    {
+        std::uint32_t const one = 1;
+        std::uint8_t little;
+        std::memcpy(&little, &one, 1);
+        return 8 * static_cast<unsigned>(little ? offset : (3 - offset));
+    }
+
+    bool grey(stereogram::PixelFormat format)
+    {
+        return (format == stereogram::PixelFormat::Grey8) || (format == stereogram::PixelFormat::Grey16)
+            || (format == stereogram::PixelFormat::GreyFloat);
+    }
+
+    std::size_t pixel_size(stereogram::PixelFormat format)
+    {
+        switch (format)
+        {
+            case stereogram::PixelFormat::Grey8:
+                return 1;
+            case stereogram::PixelFormat::Grey16:
+                return 2;
+            default:
+                return 4;
+        }
+    }
+
+    // Images are accessed a whole pixel at a time
+    bool aligned(stereogram::Image const & image)
+    {
+        std::size_t const size = pixel_size(image.format);
+        return ((reinterpret_cast<std::uintptr_t>(image.pixels) % size) == 0) && ((image.stride % size) == 0);
+    }
+
+    // Whether any of the memory spanned by two images' rows is shared
+    bool overlap(stereogram::Image const & a, stereogram::Image const & b)
+    {
+        auto span = [](stereogram::Image const & image)
+        {
+            std::uintptr_t const start = reinterpret_cast<std::uintptr_t>(image.pixels);
+            std::ptrdiff_t const rows = image.stride * std::max(0, image.h - 1);
+            std::uintptr_t const first = start + std::min<std::ptrdiff_t>(0, rows);
+            std::uintptr_t const last = start + std::max<std::ptrdiff_t>(0, rows) + (image.w * pixel_size(image.format));
+            return std::make_pair(first, last);
+        };
+        auto const sa = span(a);
+        auto const sb = span(b);
+        return (sa.first < sb.second) && (sb.first < sa.second);
+    }
+
+    // Depth from a 16-bit or floating point depth map, scaled to 0.0 .. 255.0
+    void fine_depth(stereogram::Image const & depth, std::uint8_t const * row, float * out, int first, int last)
+    {
+        if (depth.format == stereogram::PixelFormat::Grey16)
+        {
+            std::uint16_t const * src = reinterpret_cast<std::uint16_t const *>(row);
+            for (int x = first; x < last; ++x)
+                *out++ = src[x] / 257.0f;
+            return;
+        }
+        float const * src = reinterpret_cast<float const *>(row);
+        for (int x = first; x < last; ++x)
+        {
+            // Clamp to the valid range, with NaNs ending up at the far plane
+            float const v = src[x];
+            *out++ = ((v > 0.0f) ? ((v < 1.0f) ? v : 1.0f) : 0.0f) * 255.0f;
+        }
+    }
+}
+
+struct stereogram::Context::State
+{
+    unsigned threads = 1;
+    // One per thread
+    std::vector<Scratch> scratch;
+    // Tile converted to the output pixel format, if it needed to be
+    std::vector<std::uint32_t> converted;
+    TileView tile;
+    std::string error;
+};
+
+stereogram::Context::Context(unsigned threads)
+    : state(new State)
+{
+    state->threads = std::max(1u, threads);
+    state->scratch.resize(state->threads);
+}
+
+stereogram::Context::~Context() = default;
+
+std::string const & stereogram::Context::error() const
+{
+    return state->error;
+}
+
+bool stereogram::Context::render(Image const & depth, Image const & tile, Image const & output,
+        Options const & options, RowFilter const & filter)
+{
+    State & s = *state;
+    auto fail = [&](char const * message)
+    {
+        s.error = message;
+        return false;
+    };
+    if (!depth.pixels || !tile.pixels || !output.pixels)
+        return fail("Missing image");
+    bool const greyout = (output.format == PixelFormat::Grey8);
+    if (grey(tile.format) || (grey(output.format) && !greyout))
+        return fail("Tile must have 32-bit pixels, and output 32-bit or 8-bit grey pixels");
+    if (!aligned(output) || !aligned(tile) || !aligned(depth))
+        return fail("Images must be aligned to their pixel size");
+    if ((tile.w <= 0) || (tile.h <= 0) || (output.w < tile.w) || (output.h <= 0) || (depth.w < 0) || (depth.h < 0))
+        return fail("Output must be at least as wide as the tile");
+    // Every pixel in the tile must have an index which fits in 32 bits
+    if ((static_cast<std::uint64_t>(tile.w) * tile.h) > UINT32_MAX)
+        return fail("Tile image too big; max. 2^32 pixels");
+    if (!(options.divisor > 1.0))
+        return fail("Pattern length divisor must be greater than 1.0");
+
+    // Use the tile in place if it is already in the output format. Grey
+    // output is rendered in the tile's format, then converted a row at a time.
+    if ((tile.format == output.format) || greyout)
+        s.tile = {tile.w, tile.h, static_cast<std::uint32_t const *>(tile.pixels), tile.stride / 4};
+    else
+    {
+        Layout const from = layout(tile.format);
+        Layout const to = layout(output.format);
+        s.converted.resize(static_cast<std::size_t>(tile.w) * tile.h);
+        std::uint8_t * dst = reinterpret_cast<std::uint8_t *>(s.converted.data());
+        for (int y = 0; y < tile.h; ++y)
+        {
+            std::uint8_t const * src = static_cast<std::uint8_t const *>(tile.pixels) + (tile.stride * y);
+            for (int x = 0; x < tile.w; ++x, src += 4, dst += 4)
+            {
+                dst[to.a] = src[from.a];
+                dst[to.r] = src[from.r];
+                dst[to.g] = src[from.g];
+                dst[to.b] = src[from.b];
+            }
+        }
+        s.tile = {tile.w, tile.h, s.converted.data(), tile.w};
+    }
+    // The tile's pixels may have changed since the last render
+    for (Scratch & scratch : s.scratch)
+        scratch.rearrangedtile = nullptr;
+
+    // Where the depth map goes, and which of its columns are visible
+    int const ox = options.centre ? (((output.w / 2) - (depth.w / 2)) + (tile.w / 2)) : options.x;
+    int const oy = options.centre ? ((output.h / 2) - (depth.h / 2)) : options.y;
+    int const first = std::max(0, -ox);
+    int const last = std::min(depth.w, output.w - ox);
+    bool const grey8 = (depth.format == PixelFormat::Grey8);
+    bool const fine = grey(depth.format) && !grey8;
+    unsigned const red = grey(depth.format) ? 0 : byte_shift(layout(depth.format).r);
+    // Each row of depth is read in full before its output row is written,
+    // but rows are rendered in parallel, so a depth map sharing memory with
+    // the output must line up with it row for row
+    bool const shared = overlap(depth, output);
+    if (shared && ((ox != 0) || (oy != 0) || (depth.pixels != output.pixels) || (depth.stride != output.stride)))
+        return fail("Depth map may only share memory with the output at its top left corner, with the same stride");
+    // An 8-bit depth map covering whole rows of the output can be read where
+    // it is, as long as rendering won't overwrite it
+    bool const direct = grey8 && (ox == 0) && (depth.w == output.w) && !shared;
+    Layout const luma = layout(tile.format);
+    unsigned const rshift = byte_shift(luma.r);
+    unsigned const gshift = byte_shift(luma.g);
+    unsigned const bshift = byte_shift(luma.b);
+
+    // Bands of rows, but enough of them for the threads to share out evenly
+    int const band = (options.band > 0) ? options.band
+        : std::max(1, std::min(16, output.h / static_cast<int>(s.threads * 8)));
+    parallel_rows(output.h, s.threads, [&](int row, unsigned worker)
+    {
+        Scratch & scratch = s.scratch[worker];
+        std::uint8_t * const dst = static_cast<std::uint8_t *>(output.pixels) + (output.stride * row);
+        if (greyout)
+            scratch.pixels.resize(output.w);
+        std::uint32_t * out = greyout ? scratch.pixels.data() : reinterpret_cast<std::uint32_t *>(dst);
+        // Grey output is converted from the rendered row with the weights of
+        // ITU-R BT.601
+        auto convert = [&]
+        {
+            if (!greyout)
+                return;
+            for (int x = 0; x < output.w; ++x)
+            {
+                std::uint32_t const p = out[x];
+                dst[x] = static_cast<std::uint8_t>(((((p >> rshift) & 0xff) * 77) + (((p >> gshift) & 0xff) * 150)
+                            + (((p >> bshift) & 0xff) * 29) + 128) >> 8);
+            }
+        };
+        int const dy = row - oy;
+        bool const inside = (dy >= 0) && (dy < depth.h) && (first < last);
+        // Rows above and below the depth map have no depth at all
+        if (!inside && !filter)
+        {
+            render_flat_row(s.tile, out, output.w, options.top + row);
+            convert();
+            return;
+        }
+        std::uint8_t const * src = inside ? (static_cast<std::uint8_t const *>(depth.pixels) + (depth.stride * dy)) : nullptr;
+        // Pull the whole row of depth values out up front, before anything
+        // is written to the output in case they are one and the same
+        if (fine)
+        {
+            scratch.finedepth.assign(output.w, 0.0f);
+            if (inside)
+                fine_depth(depth, src, scratch.finedepth.data() + (ox + first), first, last);
+            if (filter && !filter(row, nullptr))
+                return;
+            render_row(s.tile, scratch.finedepth.data(), out, output.w, options.top + row,
+                    options.cross, options.divisor, scratch);
+            convert();
+            return;
+        }
+        std::uint8_t const * values = src;
+        if (!direct || !inside)
+        {
+            scratch.depth.assign(output.w, 0);
+            values = scratch.depth.data();
+        }
+        if (inside && !direct)
+        {
+            std::uint8_t * dst = scratch.depth.data() + (ox + first);
+            if (grey8)
+                std::copy(src + first, src + last, dst);
+            else
+                extract_channel(reinterpret_cast<std::uint32_t const *>(src) + first, dst, last - first, red);
+        }
+        if (filter && !filter(row, values))
+            return;
+        render_row(s.tile, values, out, output.w, options.top + row,
+                options.cross, options.divisor, scratch);
+        convert();
+    }, band);
+    s.error.clear();
+    return true;
+}
@@ -0,0 +1,130 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_STEREOGRAM_HXX
+#define TEXT_TO_STEREOGRAM_STEREOGRAM_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// libstereogram: renders autostereograms into memory belonging to the caller.
+//
+// A Context holds everything needed between renders (worker threads' scratch
+// space, a converted copy of the tile if it isn't already in the output pixel
+// format), so reusing one for renders of the same size allocates nothing.
+// Separate contexts are completely independent, and may be used concurrently.
+namespace stereogram
+{
+    // Layout of a pixel in memory. 32-bit formats are named by byte order, so
+    // e.g. ARGB32 is one byte each of alpha, red, green & blue, in that order.
+    enum class PixelFormat
+    {
+        // One byte per pixel; 16 bits per pixel in native byte order; or a
+        // float per pixel, from 0.0 to 1.0. Only valid for depth maps, except
+        // that output may also be Grey8.
+        Grey8,
+        Grey16,
+        GreyFloat,
+        ARGB32,
+        BGRA32,
+        RGBA32,
+        ABGR32
+    };
+
+    // An image in memory belonging to the caller. Row y starts at
+    // static_cast<char *>(pixels) + (y * stride).
+    struct Image
+    {
+        void * pixels = nullptr;
+        int w = 0;
+        int h = 0;
+        std::ptrdiff_t stride = 0;
+        PixelFormat format = PixelFormat::ARGB32;
+    };
+
+    struct Options
+    {
+        // Cross-eyed rather than wall-eyed
+        bool cross = false;
+        // Pattern length divisor: at the far plane, pattern length will be
+        // the full width of the tile; at the near plane, it will be tile
+        // width divided by this. Must be greater than 1.
+        double divisor = 2.0;
+        // Where to put the depth map's top left corner in the output. By
+        // default it is centred, but shifted right by half a tile width to
+        // account for the unmodified tile strip at the left-hand edge.
+        bool centre = true;
+        int x = 0;
+        int y = 0;
+        // Row number within the whole stereogram of the output's first row,
+        // for rendering it a strip at a time
+        int top = 0;
+        // Number of consecutive rows each thread renders at a time. Rows
+        // next to each other read mostly the same tile rows, so rendering
+        // them together keeps the working set small, which matters most for
+        // very wide outputs. 0 picks a band size from the output height and
+        // number of threads.
+        int band = 0;
+    };
+
+    // Called for each row before it is rendered, with the row's depth values
+    // (one per output pixel, depth map already positioned). Return false to
+    // leave that row of the output alone, e.g. because the caller already
+    // has it from an earlier render with the same depth. Called from worker
+    // threads, so must be safe to call concurrently for different rows.
+    // With 16-bit or floating point depth maps, depth is always null.
+    using RowFilter = std::function<bool(int row, std::uint8_t const * depth)>;
+
+    class Context
+    {
+        public:
+            // Render using the given number of threads
+            explicit Context(unsigned threads = 1);
+            ~Context();
+            Context(Context const &) = delete;
+            Context & operator=(Context const &) = delete;
+
+            // Render a stereogram into output, which must be at least as wide
+            // as the tile. The depth map may be in any format; with 32-bit
+            // formats the red channel is used as depth (0 = far, 255 = near).
+            // 16-bit and floating point depth maps are rendered with
+            // sub-pixel precision, blending neighbouring tile pixels where
+            // the pattern length isn't a whole number of pixels.
+            // Depth and tile are only read. The depth map may be the same
+            // memory as the output only when each depth row is the output
+            // row it is rendered into: same pixels and stride, with centre
+            // off and x & y of 0. Any other overlap is an error. An 8-bit
+            // depth map exactly as wide as the output, placed at its
+            // left-hand edge, is fastest: it is read in place rather than
+            // copied a row at a time, unless it shares memory with the
+            // output. Pixels come from the tile, converted to
+            // the output format; Grey8 output holds their luminance. Returns
+            // false if the images are unsuitable, with the reason available
+            // from error().
+            bool render(Image const & depth, Image const & tile, Image const & output,
+                    Options const & options, RowFilter const & filter = nullptr);
+
+            std::string const & error() const;
+
+        private:
+            struct State;
+            std::unique_ptr<State> state;
+    };
+}
+
+#endif
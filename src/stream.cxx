@@ -0,0 +1,676 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <png.h>
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include "depth.hxx"
+#include "stats.hxx"
+#include "stream.hxx"
+
+namespace
+{
+    // libpng callbacks which report errors through SDL_GetError() like
+    // everything else, and ignore warnings
+    void png_error_handler(png_structp png, png_const_charp message)
+    {
+        SDL_SetError("%s", message);
+        png_longjmp(png, 1);
+    }
+
+    void png_warning_handler(png_structp, png_const_charp)
+    {
+    }
+
+    // Shared state of the stages of render_stream(), each on its own thread,
+    // and what they wait on to hand strips to each other
+    class Pipeline
+    {
+        public:
+            // Change the state with fn, and wake up anything waiting on it
+            template <typename F> void update(F fn)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                fn();
+                changed.notify_all();
+            }
+
+            // Wait until ready() is true, with the state locked while it is
+            // called. Returns false if some stage has failed instead.
+            template <typename F> bool wait(F ready)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopped || ready(); });
+                return !stopped;
+            }
+
+            // Stop every stage, because of the error from SDL_GetError() on
+            // the calling thread (errors are kept per thread)
+            void fail()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!stopped)
+                    message = SDL_GetError();
+                stopped = true;
+                changed.notify_all();
+            }
+
+            bool failed() const
+            {
+                return stopped;
+            }
+
+            std::string const & error() const
+            {
+                return message;
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable changed;
+            bool stopped = false;
+            std::string message;
+    };
+}
+
+DepthReader::~DepthReader()
+{
+    close();
+}
+
+void DepthReader::close()
+{
+    if (png)
+        png_destroy_read_struct(&png, &info, nullptr);
+    png = nullptr;
+    info = nullptr;
+    if (file)
+        std::fclose(file);
+    file = nullptr;
+    SDL_FreeSurface(rowsurface);
+    rowsurface = nullptr;
+    SDL_FreeSurface(loaded);
+    loaded = nullptr;
+    surface = nullptr;
+    high = false;
+    pfm = false;
+    usemapped = false;
+}
+
+bool DepthReader::open(char const * filename)
+{
+    close();
+    if (MappedImage::recognised(filename))
+    {
+        if (!mapped.open(filename))
+            return false;
+        usemapped = true;
+        w = mapped.width();
+        h = mapped.height();
+        high = mapped.high_depth();
+        next = 0;
+        return true;
+    }
+    if (open_pfm(filename))
+        return true;
+    close();
+    if (open_png(filename))
+        return true;
+    close();
+    if (!(loaded = IMG_Load(filename)))
+        return false;
+    return open(loaded);
+}
+
+bool DepthReader::open(SDL_Surface * source)
+{
+    if (source != loaded)
+        close();
+    rowsurface = SDL_CreateRGBSurfaceWithFormat(0, source->w, 1, 32, SDL_PIXELFORMAT_ARGB32);
+    if (!rowsurface)
+        return false;
+    surface = source;
+    w = source->w;
+    h = source->h;
+    next = 0;
+    return true;
+}
+
+bool DepthReader::is_high_depth(char const * filename)
+{
+    DepthReader reader;
+    if (MappedImage::recognised(filename))
+        return reader.open(filename) && reader.high;
+    if (reader.open_pfm(filename))
+        return true;
+    reader.close();
+    return reader.open_png(filename) && reader.high;
+}
+
+bool DepthReader::open_pfm(char const * filename)
+{
+    if (!(file = std::fopen(filename, "rb")))
+        return false;
+    // Header: "Pf" (grey) or "PF" (RGB), width, height, and a scale whose
+    // sign gives the byte order, each followed by a single whitespace
+    // character. Only the sign of the scale is used.
+    char type[3] = {};
+    double scale = 0.0;
+    if ((std::fscanf(file, "%2s %d %d %lf", type, &w, &h, &scale) != 4)
+            || ((std::strcmp(type, "Pf") != 0) && (std::strcmp(type, "PF") != 0))
+            || !std::isspace(std::fgetc(file))
+            || (w <= 0) || (h <= 0) || (scale == 0.0))
+        return false;
+    channels = (type[1] == 'F') ? 3 : 1;
+    if ((static_cast<std::uint64_t>(w) * channels * 4 * h) > LONG_MAX)
+    {
+        SDL_SetError("PFM too big");
+        return false;
+    }
+    data = std::ftell(file);
+    std::uint32_t const one = 1;
+    std::uint8_t little;
+    std::memcpy(&little, &one, 1);
+    swap = (scale < 0.0) != (little != 0);
+    buffer.resize(static_cast<std::size_t>(w) * channels * 4);
+    pfm = true;
+    high = true;
+    next = 0;
+    return true;
+}
+
+bool DepthReader::open_png(char const * filename)
+{
+    if (!(file = std::fopen(filename, "rb")))
+        return false;
+    png_byte signature[8];
+    if ((std::fread(signature, 1, sizeof(signature), file) != sizeof(signature))
+            || (png_sig_cmp(signature, 0, sizeof(signature)) != 0))
+        return false;
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_handler, png_warning_handler);
+    if (!png)
+        return false;
+    info = png_create_info_struct(png);
+    if (!info)
+        return false;
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+    png_init_io(png, file);
+    png_set_sig_bytes(png, sizeof(signature));
+    png_read_info(png, info);
+
+    // Interlaced images can't be decoded a row at a time, and the blit of an
+    // image with transparency into the output blends it, so leave those to
+    // SDL_image. Otherwise, reduce everything to 8-bit grey or RGB, the first
+    // byte of which is the red channel.
+    if ((png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+            || (png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA)
+            || png_get_valid(png, info, PNG_INFO_tRNS)
+            || (png_get_image_width(png, info) > INT_MAX)
+            || (png_get_image_height(png, info) > INT_MAX))
+        return false;
+    // 16-bit PNGs keep all their bits, most significant byte first
+    high = (png_get_bit_depth(png, info) == 16);
+    png_set_palette_to_rgb(png);
+    png_set_expand_gray_1_2_4_to_8(png);
+    png_read_update_info(png, info);
+    w = static_cast<int>(png_get_image_width(png, info));
+    h = static_cast<int>(png_get_image_height(png, info));
+    channels = png_get_channels(png, info);
+    buffer.resize(png_get_rowbytes(png, info));
+    return true;
+}
+
+bool DepthReader::read(std::uint8_t * row)
+{
+    if (high)
+    {
+        values.resize(w);
+        if (!read(values.data()))
+            return false;
+        for (int x = 0; x < w; ++x)
+        {
+            float const v = values[x];
+            row[x] = static_cast<std::uint8_t>(std::lround(((v > 0.0f) ? ((v < 1.0f) ? v : 1.0f) : 0.0f) * 255.0f));
+        }
+        return true;
+    }
+    if (usemapped)
+    {
+        mapped.depth_row(next++, row);
+        return true;
+    }
+    if (png)
+    {
+        if (setjmp(png_jmpbuf(png)))
+            return false;
+        png_read_row(png, buffer.data(), nullptr);
+        for (int x = 0; x < w; ++x)
+            row[x] = buffer[static_cast<std::size_t>(x) * channels];
+        return true;
+    }
+    SDL_FillRect(rowsurface, nullptr, 0);
+    SDL_Rect src = {0, next++, w, 1};
+    if (SDL_BlitSurface(surface, &src, rowsurface, nullptr) != 0)
+        return false;
+    extract_channel(static_cast<std::uint32_t const *>(rowsurface->pixels), row, w, rowsurface->format->Rshift);
+    return true;
+}
+
+bool DepthReader::read(float * row)
+{
+    if (!high)
+    {
+        bytes.resize(w);
+        if (!read(bytes.data()))
+            return false;
+        for (int x = 0; x < w; ++x)
+            row[x] = bytes[x] / 255.0f;
+        return true;
+    }
+    if (usemapped)
+    {
+        mapped.depth_row(next++, row);
+        return true;
+    }
+    if (pfm)
+    {
+        long const rowbytes = static_cast<long>(buffer.size());
+        if ((std::fseek(file, data + (rowbytes * (h - 1 - next++)), SEEK_SET) != 0)
+                || (std::fread(buffer.data(), 1, buffer.size(), file) != buffer.size()))
+        {
+            SDL_SetError("Error reading PFM");
+            return false;
+        }
+        for (int x = 0; x < w; ++x)
+        {
+            std::uint8_t * p = buffer.data() + (static_cast<std::size_t>(x) * channels * 4);
+            if (swap)
+            {
+                std::swap(p[0], p[3]);
+                std::swap(p[1], p[2]);
+            }
+            std::memcpy(row + x, p, 4);
+        }
+        return true;
+    }
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+    png_read_row(png, buffer.data(), nullptr);
+    for (int x = 0; x < w; ++x)
+    {
+        std::uint8_t const * p = buffer.data() + (static_cast<std::size_t>(x) * channels * 2);
+        row[x] = ((p[0] << 8) | p[1]) / 65535.0f;
+    }
+    return true;
+}
+
+stereogram::Image DepthReader::image() const
+{
+    stereogram::Image image;
+    if (usemapped)
+        image = mapped.image();
+    if (image.format == stereogram::PixelFormat::RGBA32)
+        image.pixels = nullptr;
+    return image;
+}
+
+bool place_depth(DepthPlane & plane, DepthReader & depth, int w, int h, int tilew)
+{
+    if (!clear_plane(plane, w, h))
+        return false;
+    int const ox = ((w / 2) - (depth.width() / 2)) + (tilew / 2);
+    int const oy = (h / 2) - (depth.height() / 2);
+    int const first = std::max(0, -ox);
+    int const last = std::min(depth.width(), w - ox);
+    std::vector<std::uint8_t> row(depth.width());
+    for (int y = 0; (y < depth.height()) && ((oy + y) < h) && (first < last); ++y)
+    {
+        if (!depth.read(row.data()))
+            return false;
+        if ((oy + y) >= 0)
+            std::copy(row.begin() + first, row.begin() + last,
+                    plane.values.begin() + ((static_cast<std::size_t>(oy + y) * w) + ox + first));
+    }
+    return true;
+}
+
+bool render_stream(char const * outfname, DepthReader & depth, Tile const & tile,
+        int w, int h, bool cross, double l, unsigned jobs, int firstrow, int lastrow)
+{
+    bool const shard = (lastrow >= 0);
+    if (!shard)
+        lastrow = h;
+    ImageWriter writer;
+    if (!(shard ? writer.open_strip(outfname, w, h, firstrow, lastrow) : writer.open(outfname, w, h)))
+        return false;
+
+    // Where the depth map goes, as in place_depth(), and which of its columns
+    // are visible
+    int const ox = ((w / 2) - (depth.width() / 2)) + (tile.w / 2);
+    int const oy = (h / 2) - (depth.height() / 2);
+    int const first = std::max(0, -ox);
+    int const last = std::min(depth.width(), w - ox);
+
+    // Make strips tall enough to keep all the threads busy. PNGs are
+    // compressed in bands of a fixed number of rows (see ImageWriter), so
+    // strips are a whole number of bands, and start at multiples of their
+    // height, so that no band straddles two of them.
+    int const band = ImageWriter::bandrows;
+    int const strip = ((std::max(tile.h, static_cast<int>(jobs) * 4) + band - 1) / band) * band;
+    int const strips = ((lastrow - 1) / strip) - (firstrow / strip) + 1;
+    int const bands = ((lastrow - 1) / band) - (firstrow / band) + 1;
+    // Rows [first, last) of strip or band k, of the given height
+    auto span = [&](int height, int k)
+    {
+        int const base = (firstrow / height) + k;
+        return std::make_pair(std::max(firstrow, base * height), std::min(lastrow, (base + 1) * height));
+    };
+    std::size_t const stride = static_cast<std::size_t>(w);
+    std::size_t const striprows = std::min(strip, lastrow - firstrow);
+    // Depth maps already in memory are rendered from where they are
+    stereogram::Image const direct = depth.image();
+    bool const high = depth.high_depth() && !direct.pixels;
+
+    // Every stage runs at once:
+    //   - one thread reads the depth map into the next free depth slot
+    //   - this one renders from it into the next free output slot, on the
+    //     given number of threads
+    //   - a few more each take the next band of rendered rows, and convert
+    //     and compress it into the next free band slot
+    //   - one thread writes the bands out in order, freeing their slots
+    // Strip k always uses depth slot k % depthslots and output slot
+    // k % outputslots, and band k band slot k % bandslots, so memory use
+    // depends on the width and the strip height, but not the image height or
+    // the number of threads.
+    unsigned const encoders = std::max(1u, std::min(jobs, 4u));
+    int const depthslots = 2;
+    int const outputslots = 2;
+    int const bandslots = static_cast<int>(encoders) + 2;
+    struct DepthSlot
+    {
+        std::vector<std::uint8_t> rows;
+        std::vector<float> finerows;
+    };
+    struct BandSlot
+    {
+        ImageWriter::Band band;
+        int encoded = -1;
+    };
+    std::vector<DepthSlot> depthslot(direct.pixels ? 0 : depthslots);
+    for (DepthSlot & slot : depthslot)
+    {
+        if (high)
+            slot.finerows.resize(stride * striprows);
+        else
+            slot.rows.resize(stride * striprows);
+    }
+    std::vector<std::vector<std::uint32_t>> outputslot(outputslots);
+    for (auto & slot : outputslot)
+        slot.resize(stride * striprows);
+    std::vector<BandSlot> bandslot(bandslots);
+    Pipeline pipeline;
+    int read = direct.pixels ? strips : 0;
+    int rendered = 0;
+    int renderedrows = firstrow;
+    int written = 0;
+    int writtenrows = firstrow;
+    int nextencode = 0;
+
+    auto load = [&]
+    {
+        std::vector<std::uint8_t> sourcerow(high ? 0 : depth.width());
+        std::vector<float> finerow(high ? depth.width() : 0);
+        int nextrow = 0;
+        for (int k = 0; k < strips; ++k)
+        {
+            if (!pipeline.wait([&] { return rendered > (k - depthslots); }))
+                return;
+            DepthSlot & slot = depthslot[k % depthslots];
+            int const top = span(strip, k).first;
+            int const rows = span(strip, k).second - top;
+            stats::Timer timer(stats::Stage::LoadDepth);
+            std::fill(slot.rows.begin(), slot.rows.end(), 0);
+            std::fill(slot.finerows.begin(), slot.finerows.end(), 0.0f);
+            for (int i = 0; (i < rows) && (first < last); ++i)
+            {
+                int const row = (top + i) - oy;
+                if ((row < 0) || (row >= depth.height()))
+                    continue;
+                for (; nextrow <= row; ++nextrow)
+                {
+                    if (!(high ? depth.read(finerow.data()) : depth.read(sourcerow.data())))
+                    {
+                        pipeline.fail();
+                        return;
+                    }
+                }
+                if (high)
+                    std::copy(finerow.begin() + first, finerow.begin() + last,
+                            slot.finerows.begin() + ((stride * i) + ox + first));
+                else
+                    std::copy(sourcerow.begin() + first, sourcerow.begin() + last,
+                            slot.rows.begin() + ((stride * i) + ox + first));
+            }
+            pipeline.update([&] { ++read; });
+        }
+    };
+
+    auto encode = [&]
+    {
+        for (;;)
+        {
+            int k = 0;
+            pipeline.update([&] { k = nextencode++; });
+            if (k >= bands)
+                return;
+            int const top = span(band, k).first;
+            int const end = span(band, k).second;
+            if (!pipeline.wait([&] { return (renderedrows >= end) && (written > (k - bandslots)); }))
+                return;
+            // Where the band lies in its strip
+            int const s = (top / strip) - (firstrow / strip);
+            std::uint32_t * pixels = outputslot[s % outputslots].data()
+                + (stride * (top - span(strip, s).first));
+            BandSlot & slot = bandslot[k % bandslots];
+            stats::Timer timer(stats::Stage::Save);
+            // Convert to RGBA where the pixels are, as nothing else reads
+            // them. Pixels are ARGB32, i.e. bytes in A, R, G, B order in
+            // memory.
+            std::uint8_t * bytes = reinterpret_cast<std::uint8_t *>(pixels);
+            for (std::size_t i = 0; i < (stride * (end - top)); ++i)
+            {
+                std::uint8_t * p = bytes + (i * 4);
+                std::uint8_t const a = p[0];
+                p[0] = p[1];
+                p[1] = p[2];
+                p[2] = p[3];
+                p[3] = a;
+            }
+            if (!writer.encode(slot.band, top - firstrow, end - top, bytes, stride * 4))
+            {
+                pipeline.fail();
+                return;
+            }
+            pipeline.update([&] { slot.encoded = k; });
+        }
+    };
+
+    auto save = [&]
+    {
+        for (int k = 0; k < bands; ++k)
+        {
+            BandSlot & slot = bandslot[k % bandslots];
+            if (!pipeline.wait([&] { return slot.encoded == k; }))
+                return;
+            stats::Timer timer(stats::Stage::Save);
+            if (!writer.write(slot.band))
+            {
+                pipeline.fail();
+                return;
+            }
+            pipeline.update([&]
+            {
+                ++written;
+                writtenrows = span(band, k).second;
+            });
+        }
+    };
+
+    std::vector<std::thread> threads;
+    if (!direct.pixels)
+        threads.emplace_back(load);
+    for (unsigned i = 0; i < encoders; ++i)
+        threads.emplace_back(encode);
+    threads.emplace_back(save);
+
+    stereogram::Context context(jobs);
+    stereogram::Options options;
+    options.cross = cross;
+    options.divisor = l;
+    options.centre = false;
+    for (int k = 0; k < strips; ++k)
+    {
+        // The strip which used this output slot must be written out first
+        int const reused = (k >= outputslots) ? span(strip, k - outputslots).second : firstrow;
+        if (!pipeline.wait([&] { return (read > k) && (writtenrows >= reused); }))
+            break;
+        int const top = span(strip, k).first;
+        int const rows = span(strip, k).second - top;
+        stereogram::Image output = {outputslot[k % outputslots].data(), w, rows, w * 4,
+            stereogram::PixelFormat::ARGB32};
+        stereogram::Image depthstrip = direct;
+        if (direct.pixels)
+        {
+            options.x = ox;
+            options.y = oy - top;
+        }
+        else if (high)
+            depthstrip = {depthslot[k % depthslots].finerows.data(), w, rows,
+                static_cast<std::ptrdiff_t>(w * sizeof(float)), stereogram::PixelFormat::GreyFloat};
+        else
+            depthstrip = {depthslot[k % depthslots].rows.data(), w, rows, w, stereogram::PixelFormat::Grey8};
+        options.top = top;
+        bool ok;
+        {
+            stats::Timer timer(stats::Stage::Render);
+            ok = context.render(depthstrip, tile.image(), output, options);
+        }
+        if (!ok)
+        {
+            SDL_SetError("%s", context.error().c_str());
+            pipeline.fail();
+            break;
+        }
+        pipeline.update([&]
+        {
+            ++rendered;
+            renderedrows = top + rows;
+        });
+    }
+    for (auto & t : threads)
+        t.join();
+    if (pipeline.failed())
+    {
+        SDL_SetError("%s", pipeline.error().c_str());
+        return false;
+    }
+    stats::Timer timer(stats::Stage::Save);
+    return writer.finish();
+}
+
+bool merge_strips(char const * outfname, std::vector<char const *> const & stripnames)
+{
+    // Check the strips fit together before writing anything
+    struct Strip
+    {
+        char const * name;
+        int first;
+        int last;
+    };
+    std::vector<Strip> strips;
+    int w = 0;
+    int h = 0;
+    for (char const * name : stripnames)
+    {
+        StripReader reader;
+        if (!reader.open(name))
+            return false;
+        if (strips.empty())
+        {
+            w = reader.width();
+            h = reader.height();
+        }
+        else if ((reader.width() != w) || (reader.height() != h))
+        {
+            SDL_SetError("%s is from a different size of image", name);
+            return false;
+        }
+        strips.push_back({name, reader.first(), reader.last()});
+    }
+    std::sort(strips.begin(), strips.end(), [](Strip const & a, Strip const & b)
+    {
+        return a.first < b.first;
+    });
+    int next = 0;
+    for (Strip const & strip : strips)
+    {
+        if (strip.first != next)
+        {
+            SDL_SetError((strip.first < next) ? "Strips overlap at row %d" : "Strips are missing row %d",
+                    std::min(strip.first, next));
+            return false;
+        }
+        next = strip.last;
+    }
+    if (strips.empty() || (next != h))
+    {
+        SDL_SetError("Strips are missing row %d", next);
+        return false;
+    }
+
+    ImageWriter writer;
+    if (!writer.open(outfname, w, h))
+        return false;
+    std::vector<std::uint8_t> row(static_cast<std::size_t>(w) * 4);
+    for (Strip const & strip : strips)
+    {
+        StripReader reader;
+        if (!reader.open(strip.name))
+            return false;
+        for (int y = strip.first; y < strip.last; ++y)
+        {
+            if (!reader.read(row.data()) || !writer.write(row.data()))
+                return false;
+        }
+    }
+    return writer.finish();
+}
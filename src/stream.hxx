@@ -0,0 +1,142 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_STREAM_HXX
+#define TEXT_TO_STEREOGRAM_STREAM_HXX
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <png.h>
+#include <SDL.h>
+
+#include "formats.hxx"
+#include "images.hxx"
+
+// Streaming renderer, for output too big to comfortably hold in memory all at
+// once. The depth map is read, and the output rendered & written, a strip of
+// rows at a time, so memory use depends on the output width but not height.
+// Functions which can fail return false, with the reason available from
+// SDL_GetError().
+
+// Supplies the depth values of a depth map one row at a time, top to bottom
+class DepthReader
+{
+    public:
+        DepthReader() = default;
+        DepthReader(DepthReader const &) = delete;
+        DepthReader & operator=(DepthReader const &) = delete;
+        ~DepthReader();
+
+        // Open a depth map image. Uncompressed formats (see MappedImage) are
+        // mapped into memory, and opaque, non-interlaced PNGs and PFM
+        // (portable float map) files are read incrementally; anything else is
+        // loaded whole with SDL_image. 16-bit images and PFMs keep their full
+        // precision, with PFM values from 0.0 (far) to 1.0 (near).
+        bool open(char const * filename);
+
+        // Whether open() would read the given file at more than 8 bits of
+        // precision, without reading any more of it than the header
+        static bool is_high_depth(char const * filename);
+
+        // Read depth from a surface already in memory, e.g. rendered text.
+        // The surface must outlive the reader.
+        bool open(SDL_Surface * source);
+
+        int width() const
+        {
+            return w;
+        }
+
+        int height() const
+        {
+            return h;
+        }
+
+        // Whether depth values have more than 8 bits of precision
+        bool high_depth() const
+        {
+            return high;
+        }
+
+        // Read the next row's depth values, width() of them, either rounded
+        // to 0 .. 255, or from 0.0 to 1.0
+        bool read(std::uint8_t * row);
+        bool read(float * row);
+
+        // The whole depth map, if it is mapped into memory in a form the
+        // renderer can read where it lies (8-bit grey, or 16-bit grey in
+        // native byte order). Otherwise, pixels is null.
+        stereogram::Image image() const;
+
+    private:
+        bool open_png(char const * filename);
+        bool open_pfm(char const * filename);
+        void close();
+
+        int w = 0;
+        int h = 0;
+        bool high = false;
+        // Incremental PNG decoding
+        std::FILE * file = nullptr;
+        png_structp png = nullptr;
+        png_infop info = nullptr;
+        std::vector<std::uint8_t> buffer;
+        int channels = 0;
+        // Uncompressed formats are read straight out of memory
+        MappedImage mapped;
+        bool usemapped = false;
+        // PFMs are stored bottom row first, so each row is found by seeking
+        bool pfm = false;
+        long data = 0;
+        bool swap = false;
+        // Rows converted from the other precision
+        std::vector<std::uint8_t> bytes;
+        std::vector<float> values;
+        // Otherwise, rows are blitted out of a surface one at a time, so that
+        // they come out exactly as when blitting the whole depth map
+        SDL_Surface * surface = nullptr;
+        SDL_Surface * loaded = nullptr;
+        SDL_Surface * rowsurface = nullptr;
+        int next = 0;
+};
+
+// Render a w x h stereogram with the depth map placed as by place_depth(),
+// and save it in the format given by outfname's extension (see ImageWriter),
+// or write it to standard output as raw, 8-bit RGBA pixels if outfname is
+// "-". Depth maps mapped into memory are rendered from where they lie. Rows are rendered on the given number of
+// threads, in strips at least as tall as the tile. Depth maps with more than 8
+// bits of precision are rendered with sub-pixel precision. Reading, rendering
+// and writing overlap: while one strip renders, the next is read in, and
+// the one before it is compressed, on a few more threads, and written. The
+// file is the same whatever the number of threads.
+// If lastrow isn't negative, only rows [firstrow, lastrow) are rendered, and written
+// as a strip (see StripReader) for merging with the rest later. Every row is
+// rendered independently of the others, so the strip's rows are exactly the
+// same as in the whole image.
+bool render_stream(char const * outfname, DepthReader & depth, Tile const & tile,
+        int w, int h, bool cross, double l, unsigned jobs, int firstrow = 0, int lastrow = -1);
+
+// Join strips which between them cover a whole image exactly once, given in
+// any order, and save the result as render_stream() would have. Only one row
+// is held in memory at a time.
+bool merge_strips(char const * outfname, std::vector<char const *> const & stripnames);
+
+// Fill a w x h depth plane from the rest of a depth map's rows, placed as by
+// the other place_depth()
+bool place_depth(DepthPlane & plane, DepthReader & depth, int w, int h, int tilew);
+
+#endif
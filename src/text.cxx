@@ -0,0 +1,336 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "text.hxx"
+
+namespace
+{
+    // SDL_ttf 2.0.18 added 32-bit versions of the per-glyph functions; before
+    // that, only the Basic Multilingual Plane is available
+#ifdef SDL_TTF_VERSION_ATLEAST
+#if SDL_TTF_VERSION_ATLEAST(2, 0, 18)
+#define TEXT_TO_STEREOGRAM_TTF_GLYPH32
+#endif
+#endif
+
+#ifdef TEXT_TO_STEREOGRAM_TTF_GLYPH32
+    bool provided(TTF_Font * font, std::uint32_t c)
+    {
+        return TTF_GlyphIsProvided32(font, c) != 0;
+    }
+
+    int metrics(TTF_Font * font, std::uint32_t c, int * minx, int * advance)
+    {
+        int maxx, miny, maxy;
+        return TTF_GlyphMetrics32(font, c, minx, &maxx, &miny, &maxy, advance);
+    }
+
+    SDL_Surface * rasterise(TTF_Font * font, std::uint32_t c)
+    {
+        return TTF_RenderGlyph32_Solid(font, c, {255, 255, 255, 255});
+    }
+
+    int kerning(TTF_Font * font, std::uint32_t previous, std::uint32_t c)
+    {
+        return TTF_GetFontKerningSizeGlyphs32(font, previous, c);
+    }
+#else
+    bool provided(TTF_Font * font, std::uint32_t c)
+    {
+        return (c <= 0xffff) && (TTF_GlyphIsProvided(font, static_cast<Uint16>(c)) != 0);
+    }
+
+    int metrics(TTF_Font * font, std::uint32_t c, int * minx, int * advance)
+    {
+        int maxx, miny, maxy;
+        return TTF_GlyphMetrics(font, static_cast<Uint16>(c), minx, &maxx, &miny, &maxy, advance);
+    }
+
+    SDL_Surface * rasterise(TTF_Font * font, std::uint32_t c)
+    {
+        return TTF_RenderGlyph_Solid(font, static_cast<Uint16>(c), {255, 255, 255, 255});
+    }
+
+    int kerning(TTF_Font * font, std::uint32_t previous, std::uint32_t c)
+    {
+        if ((previous > 0xffff) || (c > 0xffff))
+            return 0;
+        return TTF_GetFontKerningSizeGlyphs(font, static_cast<Uint16>(previous), static_cast<Uint16>(c));
+    }
+#endif
+
+    // Decode the UTF-8 character starting at text[i], moving i past it.
+    // Malformed sequences come out as U+FFFD, one byte at a time.
+    std::uint32_t decode(std::string const & text, std::size_t & i)
+    {
+        std::uint8_t const first = static_cast<std::uint8_t>(text[i++]);
+        if (first < 0x80)
+            return first;
+        int length;
+        std::uint32_t c;
+        if ((first & 0xe0) == 0xc0)
+        {
+            length = 1;
+            c = first & 0x1f;
+        }
+        else if ((first & 0xf0) == 0xe0)
+        {
+            length = 2;
+            c = first & 0x0f;
+        }
+        else if ((first & 0xf8) == 0xf0)
+        {
+            length = 3;
+            c = first & 0x07;
+        }
+        else
+            return 0xfffd;
+        std::size_t j = i;
+        for (int n = 0; n < length; ++n, ++j)
+        {
+            if ((j >= text.size()) || ((static_cast<std::uint8_t>(text[j]) & 0xc0) != 0x80))
+                return 0xfffd;
+            c = (c << 6) | (static_cast<std::uint8_t>(text[j]) & 0x3f);
+        }
+        i = j;
+        return c;
+    }
+}
+
+GlyphAtlas::~GlyphAtlas()
+{
+    for (auto & f : fonts)
+        TTF_CloseFont(f.second);
+}
+
+TTF_Font * GlyphAtlas::font(std::string const & fontname, int size)
+{
+    auto const key = std::make_tuple(fontname, size);
+    auto const found = fonts.find(key);
+    if (found != fonts.end())
+        return found->second;
+    TTF_Font * opened = TTF_OpenFont(fontname.c_str(), size);
+    if (!opened)
+        return nullptr;
+    fonts.emplace(key, opened);
+    return opened;
+}
+
+GlyphAtlas::Glyph const * GlyphAtlas::glyph(TTF_Font * font, std::string const & fontname, int size, std::uint32_t codepoint)
+{
+    auto const key = std::make_tuple(fontname, size, codepoint);
+    auto const found = glyphs.find(key);
+    if (found != glyphs.end())
+        return &found->second;
+
+    // Characters the font doesn't have take up no space
+    Glyph glyph = {pixels.size(), 0, 0, 0, 0};
+    int minx;
+    if (provided(font, codepoint) && (metrics(font, codepoint, &minx, &glyph.advance) == 0))
+    {
+        SDL_Surface * surface = rasterise(font, codepoint);
+        if (!surface)
+            return nullptr;
+        if (surface->format->BytesPerPixel != 1)
+        {
+            SDL_SetError("Unexpected glyph format: %d bytes per pixel", surface->format->BytesPerPixel);
+            SDL_FreeSurface(surface);
+            return nullptr;
+        }
+        // Glyphs rendered alone start at whichever is further left of the
+        // pen position and the glyph's left-hand edge
+        glyph.w = surface->w;
+        glyph.h = surface->h;
+        glyph.x = std::min(0, minx);
+        Uint32 background = 0;
+        SDL_GetColorKey(surface, &background);
+        pixels.resize(glyph.offset + (static_cast<std::size_t>(glyph.w) * glyph.h));
+        std::uint8_t * dst = pixels.data() + glyph.offset;
+        for (int y = 0; y < glyph.h; ++y)
+        {
+            std::uint8_t const * src = static_cast<std::uint8_t const *>(surface->pixels) + (surface->pitch * y);
+            for (int x = 0; x < glyph.w; ++x)
+                *dst++ = (src[x] != background);
+        }
+        SDL_FreeSurface(surface);
+    }
+    return &glyphs.emplace(key, glyph).first->second;
+}
+
+SDL_Surface * GlyphAtlas::render(std::string const & fontname, int size, std::string const & text, int depth)
+{
+    TTF_Font * f = font(fontname, size);
+    if (!f)
+        return nullptr;
+
+    // Work out where each glyph goes, and the extent of each line
+    struct Placed
+    {
+        Glyph const * glyph;
+        int x;
+        int y;
+    };
+    struct Line
+    {
+        std::size_t end;
+        int left;
+        int right;
+    };
+    std::vector<Placed> placed;
+    std::vector<Line> lines;
+    bool const kern = (TTF_GetFontKerning(f) != 0);
+    int const lineskip = TTF_FontLineSkip(f);
+    int pen = 0;
+    int y = 0;
+    Line line = {0, 0, 0};
+    std::uint32_t previous = 0;
+    for (std::size_t i = 0; i <= text.size();)
+    {
+        std::uint32_t const c = (i < text.size()) ? decode(text, i) : '\n';
+        if (c == '\n')
+        {
+            line.end = placed.size();
+            lines.push_back(line);
+            line = {0, 0, 0};
+            pen = 0;
+            y += lineskip;
+            previous = 0;
+            if (i == text.size())
+                break;
+            continue;
+        }
+        Glyph const * g = glyph(f, fontname, size, c);
+        if (!g)
+            return nullptr;
+        if (kern && (previous != 0))
+            pen += kerning(f, previous, c);
+        placed.push_back({g, pen + g->x, y});
+        line.left = std::min(line.left, pen + g->x);
+        line.right = std::max({line.right, pen + g->x + g->w, pen + g->advance});
+        pen += g->advance;
+        previous = c;
+    }
+    int w = 0;
+    for (Line const & l : lines)
+        w = std::max(w, l.right - l.left);
+    int const h = (y - lineskip) + TTF_FontHeight(f);
+    if ((w <= 0) || (h <= 0))
+    {
+        SDL_SetError("Text has zero width");
+        return nullptr;
+    }
+
+    // Draw the glyphs, with each line centred
+    SDL_Surface * surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB32);
+    if (!surface)
+        return nullptr;
+    SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+    SDL_FillRect(surface, nullptr, 0);
+    std::uint8_t const d = static_cast<std::uint8_t>(depth);
+    Uint32 const value = SDL_MapRGBA(surface->format, d, d, d, 255);
+    std::size_t first = 0;
+    for (Line const & l : lines)
+    {
+        int const shift = ((w - (l.right - l.left)) / 2) - l.left;
+        for (std::size_t i = first; i < l.end; ++i)
+        {
+            Placed const & p = placed[i];
+            std::uint8_t const * src = pixels.data() + p.glyph->offset;
+            for (int gy = 0; gy < p.glyph->h; ++gy, src += p.glyph->w)
+            {
+                int const sy = p.y + gy;
+                if ((sy < 0) || (sy >= h))
+                    continue;
+                Uint32 * row = reinterpret_cast<Uint32 *>(static_cast<std::uint8_t *>(surface->pixels) + (surface->pitch * sy));
+                for (int gx = 0; gx < p.glyph->w; ++gx)
+                {
+                    int const sx = p.x + shift + gx;
+                    if (src[gx] && (sx >= 0) && (sx < w))
+                        row[sx] = value;
+                }
+            }
+        }
+        first = l.end;
+    }
+    return surface;
+}
+
+bool parse_batch_line(std::string const & text, BatchLine & line)
+{
+    // Settings, up to the last tab
+    std::size_t start = 0;
+    for (std::size_t tab; (tab = text.find('\t', start)) != std::string::npos; start = tab + 1)
+    {
+        std::string const setting = text.substr(start, tab - start);
+        std::size_t const equals = setting.find('=');
+        std::string const key = setting.substr(0, equals);
+        std::string const value = (equals == std::string::npos) ? std::string() : setting.substr(equals + 1);
+        if (equals == std::string::npos)
+        {
+            SDL_SetError("Expected key=value, not \"%s\"", setting.c_str());
+            return false;
+        }
+        if ((key == "depth") || (key == "size"))
+        {
+            char * end;
+            long const n = std::strtol(value.c_str(), &end, 10);
+            if (value.empty() || (*end != '\0') || (n <= 0) || (n > ((key == "depth") ? 255 : 10000)))
+            {
+                SDL_SetError("Invalid %s: \"%s\"", key.c_str(), value.c_str());
+                return false;
+            }
+            ((key == "depth") ? line.depth : line.size) = static_cast<int>(n);
+        }
+        else if (key == "font")
+            line.font = value;
+        else if (key == "output")
+            line.output = value;
+        else
+        {
+            SDL_SetError("Unrecognised setting \"%s\"", key.c_str());
+            return false;
+        }
+    }
+
+    // The text itself, with escapes expanded
+    line.text.clear();
+    for (std::size_t i = start; i < text.size(); ++i)
+    {
+        char c = text[i];
+        if ((c == '\\') && ((i + 1) < text.size()))
+        {
+            switch (text[++i])
+            {
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case '\\':
+                    c = '\\';
+                    break;
+                default:
+                    --i;
+            }
+        }
+        line.text += c;
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+// Copyright 2022 Philip Allison
+// 
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+// 
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+#ifndef TEXT_TO_STEREOGRAM_TEXT_HXX
+#define TEXT_TO_STEREOGRAM_TEXT_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <SDL.h>
+#include <SDL_ttf.h>
+
+// Text depth maps for rendering lots of strings in one go. Every glyph is
+// rasterised once, into an atlas, and text is laid out from the cached
+// glyphs, so only the first few strings in a font & size pay for
+// rasterisation. Functions which can fail return false or nullptr, with the
+// reason available from SDL_GetError(). Needs SDL_ttf to be initialised for as
+// long as the atlas exists.
+class GlyphAtlas
+{
+    public:
+        GlyphAtlas() = default;
+        GlyphAtlas(GlyphAtlas const &) = delete;
+        GlyphAtlas & operator=(GlyphAtlas const &) = delete;
+        ~GlyphAtlas();
+
+        // Lay out UTF-8 text, with lines separated by '\n' and centred on
+        // each other, and render it at the given depth (1 = far, 255 = near)
+        // into an ARGB32 surface, for use as a depth map
+        SDL_Surface * render(std::string const & fontname, int size, std::string const & text, int depth);
+
+    private:
+        // Glyph coverage, as one byte per pixel (non-zero = covered) at
+        // offset within pixels, positioned as when rendering the glyph alone:
+        // its top row is the top of the line, and its left-hand column is x
+        // pixels from the pen position
+        struct Glyph
+        {
+            std::size_t offset;
+            int w;
+            int h;
+            int x;
+            int advance;
+        };
+
+        TTF_Font * font(std::string const & fontname, int size);
+        Glyph const * glyph(TTF_Font * font, std::string const & fontname, int size, std::uint32_t codepoint);
+
+        std::map<std::tuple<std::string, int>, TTF_Font *> fonts;
+        std::map<std::tuple<std::string, int, std::uint32_t>, Glyph> glyphs;
+        std::vector<std::uint8_t> pixels;
+};
+
+// One line of a batch of strings to render: the text, optionally preceded by
+// tab-separated key=value settings for just this string. Recognised keys are
+// depth, size, font and output. In the text, "\n" starts a new line, "\t" is
+// a tab and "\\" a backslash.
+struct BatchLine
+{
+    std::string text;
+    std::string font;
+    int size = 0;
+    int depth = 0;
+    std::string output;
+};
+
+// Parse a line of a batch into line, which holds the defaults for anything
+// the line doesn't set
+bool parse_batch_line(std::string const & text, BatchLine & line);
+
+#endif
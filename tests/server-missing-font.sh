@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Copyright 2022 Philip Allison
+#
+# This program is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program. If not, see <https://www.gnu.org/licenses/>. 
+
+# Ask the server for a font that doesn't exist, twice, and check that both
+# requests come back with an error rather than hanging the worker.
+# Usage: server-missing-font.sh <text-to-stereogram> <tile>
+
+exe=$1
+tile=$2
+request='{"id": "%s", "tile": "%s", "font": "/nonexistent/font.ttf", "text": "Hi", "width": 800, "height": 400, "output": "/dev/null"}\n'
+replies=$( (printf "$request" 1 "$tile"; printf "$request" 2 "$tile") | "$exe" -S -j1) || exit 1
+errors=$(printf '%s\n' "$replies" | grep -c '"status": "error", "error": "Unable to open font: ')
+if [ "$errors" -ne 2 ]
+then
+    echo "Unexpected replies: $replies" >&2
+    exit 1
+fi